@@ -0,0 +1,269 @@
+/*
+ * BLAKE3 cryptographic hash function.
+ * Jack O'Connor, Jean-Philippe Aumasson, Samuel Neves, Zooko Wilcox-O'Hearn.
+ *
+ * Released into the public domain with CC0 1.0 (see reference implementation
+ * at https://github.com/BLAKE3-team/BLAKE3).
+ *
+ * This is a portable, single-threaded rewrite of the reference implementation
+ * that only produces default (unkeyed) 256-bit digests.
+ */
+
+#include <string.h>
+
+#include "blake3.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+/* Number of chunks hashed in parallel by vector code (0 disables it). */
+#ifndef BLAKE3_LANES
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define BLAKE3_LANES 4
+#endif
+#elif BLAKE3_LANES == 0
+#undef BLAKE3_LANES
+#endif
+
+static const uint32_t IV[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                               0xA54FF53A, 0x510E527F, 0x9B05688C,
+                               0x1F83D9AB, 0x5BE0CD19};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y)                                                    \
+  {                                                                            \
+    (a) += (b) + (x);                                                          \
+    (d) = ROTR32((d) ^ (a), 16);                                               \
+    (c) += (d);                                                                \
+    (b) = ROTR32((b) ^ (c), 12);                                               \
+    (a) += (b) + (y);                                                          \
+    (d) = ROTR32((d) ^ (a), 8);                                                \
+    (c) += (d);                                                                \
+    (b) = ROTR32((b) ^ (c), 7);                                                \
+  }
+
+/* One round with message words permuted by the given schedule. */
+#define ROUND(s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, s12, s13, s14, \
+              s15)                                                             \
+  {                                                                            \
+    G(v[0], v[4], v[8], v[12], m[s0], m[s1]);                                  \
+    G(v[1], v[5], v[9], v[13], m[s2], m[s3]);                                  \
+    G(v[2], v[6], v[10], v[14], m[s4], m[s5]);                                 \
+    G(v[3], v[7], v[11], v[15], m[s6], m[s7]);                                 \
+    G(v[0], v[5], v[10], v[15], m[s8], m[s9]);                                 \
+    G(v[1], v[6], v[11], v[12], m[s10], m[s11]);                               \
+    G(v[2], v[7], v[8], v[13], m[s12], m[s13]);                                \
+    G(v[3], v[4], v[9], v[14], m[s14], m[s15]);                                \
+  }
+
+/* Compresses `block` into chaining value `cv`. Stores all 16 state words in
+ * `out` (first 8 of them are the new chaining value). */
+static void BLAKE3Compress(const uint32_t cv[8], const unsigned char *block,
+                           unsigned len, uint64_t counter, uint32_t flags,
+                           uint32_t out[16]) {
+  uint32_t m[16], v[16];
+
+  memcpy(m, block, sizeof(m));
+  memcpy(v, cv, 8 * sizeof(uint32_t));
+  memcpy(v + 8, IV, 4 * sizeof(uint32_t));
+  v[12] = (uint32_t)counter;
+  v[13] = (uint32_t)(counter >> 32);
+  v[14] = len;
+  v[15] = flags;
+
+  /* Rounds are spelled out, so message words stay in registers. */
+  ROUND(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  ROUND(2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8);
+  ROUND(3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1);
+  ROUND(10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6);
+  ROUND(12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4);
+  ROUND(9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7);
+  ROUND(11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13);
+
+  for (int i = 0; i < 8; i++) {
+    out[i] = v[i] ^ v[i + 8];
+    out[i + 8] = v[i + 8] ^ cv[i];
+  }
+}
+
+/* Computes chaining value of parent node from two children. */
+static void BLAKE3Parent(const uint32_t left[8], const uint32_t right[8],
+                         uint32_t flags, uint32_t cv[8]) {
+  unsigned char block[BLAKE3_BLOCK_LENGTH];
+  uint32_t out[16];
+
+  memcpy(block, left, 32);
+  memcpy(block + 32, right, 32);
+  BLAKE3Compress(IV, block, BLAKE3_BLOCK_LENGTH, 0, PARENT | flags, out);
+  memcpy(cv, out, 32);
+}
+
+static inline uint32_t BLAKE3StartFlag(const BLAKE3_CTX *ctx) {
+  return ctx->blocks == 0 ? CHUNK_START : 0;
+}
+
+/* Merges chaining value `cv` of a completed chunk with completed subtrees,
+ * i.e. one for each trailing zero bit of the number of chunks so far. */
+static void BLAKE3AddChunk(BLAKE3_CTX *ctx, uint32_t cv[8]) {
+  uint64_t total = ++ctx->chunk;
+  for (; (total & 1) == 0; total >>= 1)
+    BLAKE3Parent(ctx->stack[--ctx->depth], cv, 0, cv);
+  memcpy(ctx->stack[ctx->depth++], cv, 32);
+}
+
+#ifdef BLAKE3_LANES
+/* Hashes BLAKE3_LANES consecutive whole chunks at once, one in each lane of
+ * a vector, and adds their chaining values. Compilers map the vector type to
+ * SSE2, AVX2 or NEON registers depending on target. */
+typedef uint32_t lanes_t __attribute__((vector_size(4 * BLAKE3_LANES)));
+
+static void BLAKE3ChunksWide(BLAKE3_CTX *ctx, const unsigned char *input) {
+  lanes_t cv[8], m[16], v[16], lo, hi, zero = {0};
+
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < BLAKE3_LANES; j++)
+      cv[i][j] = IV[i];
+
+  for (int j = 0; j < BLAKE3_LANES; j++) {
+    lo[j] = (uint32_t)(ctx->chunk + j);
+    hi[j] = (uint32_t)((ctx->chunk + j) >> 32);
+  }
+
+  for (int b = 0; b < BLAKE3_CHUNK_LENGTH / BLAKE3_BLOCK_LENGTH; b++) {
+    uint32_t flags = (b == 0 ? CHUNK_START : 0) |
+                     (b == BLAKE3_CHUNK_LENGTH / BLAKE3_BLOCK_LENGTH - 1
+                        ? CHUNK_END
+                        : 0);
+
+    for (int j = 0; j < BLAKE3_LANES; j++) {
+      uint32_t w[16];
+      memcpy(w, input + j * BLAKE3_CHUNK_LENGTH + b * BLAKE3_BLOCK_LENGTH,
+             sizeof(w));
+      for (int i = 0; i < 16; i++)
+        m[i][j] = w[i];
+    }
+
+    for (int i = 0; i < 8; i++)
+      v[i] = cv[i];
+    for (int i = 0; i < 4; i++)
+      v[i + 8] = zero + IV[i];
+    v[12] = lo;
+    v[13] = hi;
+    v[14] = zero + BLAKE3_BLOCK_LENGTH;
+    v[15] = zero + flags;
+
+    ROUND(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    ROUND(2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8);
+    ROUND(3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1);
+    ROUND(10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6);
+    ROUND(12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4);
+    ROUND(9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7);
+    ROUND(11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13);
+
+    for (int i = 0; i < 8; i++)
+      cv[i] = v[i] ^ v[i + 8];
+  }
+
+  for (int j = 0; j < BLAKE3_LANES; j++) {
+    uint32_t out[8];
+    for (int i = 0; i < 8; i++)
+      out[i] = cv[i][j];
+    BLAKE3AddChunk(ctx, out);
+  }
+}
+#endif
+
+/* Finishes current chunk and adds its chaining value. */
+static void BLAKE3PushChunk(BLAKE3_CTX *ctx) {
+  uint32_t out[16];
+  uint32_t cv[8];
+
+  BLAKE3Compress(ctx->cv, ctx->buffer, ctx->buflen, ctx->chunk,
+                 BLAKE3StartFlag(ctx) | CHUNK_END, out);
+  memcpy(cv, out, 32);
+
+  BLAKE3AddChunk(ctx, cv);
+
+  memcpy(ctx->cv, IV, 32);
+  ctx->buflen = 0;
+  ctx->blocks = 0;
+}
+
+void BLAKE3Init(BLAKE3_CTX *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+  memcpy(ctx->cv, IV, 32);
+}
+
+void BLAKE3Update(BLAKE3_CTX *ctx, const void *in, size_t len) {
+  const unsigned char *input = in;
+  uint32_t out[16];
+
+  while (len > 0) {
+    /* Last block of a chunk is compressed with different flags, so a full
+     * buffer is kept until we know more input follows. */
+    if (ctx->buflen == BLAKE3_BLOCK_LENGTH) {
+      if (ctx->blocks == BLAKE3_CHUNK_LENGTH / BLAKE3_BLOCK_LENGTH - 1) {
+        BLAKE3PushChunk(ctx);
+      } else {
+        BLAKE3Compress(ctx->cv, ctx->buffer, BLAKE3_BLOCK_LENGTH, ctx->chunk,
+                       BLAKE3StartFlag(ctx), out);
+        memcpy(ctx->cv, out, 32);
+        ctx->blocks++;
+        ctx->buflen = 0;
+      }
+    }
+
+#ifdef BLAKE3_LANES
+    /* At chunk boundary hash whole chunks side by side. Last chunk of input
+     * must go through the buffer, as it is finished by BLAKE3Final. */
+    while (ctx->buflen == 0 && ctx->blocks == 0 &&
+           len > BLAKE3_LANES * BLAKE3_CHUNK_LENGTH) {
+      BLAKE3ChunksWide(ctx, input);
+      input += BLAKE3_LANES * BLAKE3_CHUNK_LENGTH;
+      len -= BLAKE3_LANES * BLAKE3_CHUNK_LENGTH;
+    }
+#endif
+
+    size_t take = BLAKE3_BLOCK_LENGTH - ctx->buflen;
+    if (take > len)
+      take = len;
+    memcpy(ctx->buffer + ctx->buflen, input, take);
+    ctx->buflen += take;
+    input += take;
+    len -= take;
+  }
+}
+
+void BLAKE3Final(unsigned char digest[BLAKE3_DIGEST_LENGTH], BLAKE3_CTX *ctx) {
+  uint32_t out[16];
+  uint32_t flags = BLAKE3StartFlag(ctx) | CHUNK_END;
+
+  /* Last block is padded with zeros. */
+  memset(ctx->buffer + ctx->buflen, 0, BLAKE3_BLOCK_LENGTH - ctx->buflen);
+
+  if (ctx->depth == 0) {
+    /* Single chunk is the root itself. */
+    BLAKE3Compress(ctx->cv, ctx->buffer, ctx->buflen, ctx->chunk,
+                   flags | ROOT, out);
+  } else {
+    uint32_t cv[8];
+
+    BLAKE3Compress(ctx->cv, ctx->buffer, ctx->buflen, ctx->chunk, flags, out);
+    memcpy(cv, out, 32);
+
+    /* Merge right spine of the tree, last merge producing the root. */
+    while (ctx->depth > 1)
+      BLAKE3Parent(ctx->stack[--ctx->depth], cv, 0, cv);
+
+    unsigned char block[BLAKE3_BLOCK_LENGTH];
+    memcpy(block, ctx->stack[0], 32);
+    memcpy(block + 32, cv, 32);
+    BLAKE3Compress(IV, block, BLAKE3_BLOCK_LENGTH, 0, PARENT | ROOT, out);
+  }
+
+  memcpy(digest, out, BLAKE3_DIGEST_LENGTH);
+  memset(ctx, 0, sizeof(*ctx));
+}
@@ -0,0 +1,35 @@
+/*
+ * BLAKE3 cryptographic hash function.
+ * Jack O'Connor, Jean-Philippe Aumasson, Samuel Neves, Zooko Wilcox-O'Hearn.
+ *
+ * Released into the public domain with CC0 1.0 (see reference implementation
+ * at https://github.com/BLAKE3-team/BLAKE3).
+ */
+
+#ifndef _BLAKE3_H_
+#define _BLAKE3_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_BLOCK_LENGTH 64
+#define BLAKE3_CHUNK_LENGTH 1024
+#define BLAKE3_DIGEST_LENGTH 32
+#define BLAKE3_MAX_DEPTH 54 /* enough for 2^64 bytes of input */
+
+/* BLAKE3 context. */
+typedef struct BLAKE3Context {
+  uint32_t cv[8];                              /* chunk chaining value */
+  uint64_t chunk;                              /* current chunk number */
+  unsigned char buffer[BLAKE3_BLOCK_LENGTH];   /* input buffer */
+  unsigned buflen;                             /* bytes in input buffer */
+  unsigned blocks;                             /* blocks compressed in chunk */
+  unsigned depth;                              /* entries on `stack` */
+  uint32_t stack[BLAKE3_MAX_DEPTH][8];         /* subtree chaining values */
+} BLAKE3_CTX;
+
+void BLAKE3Init(BLAKE3_CTX *);
+void BLAKE3Update(BLAKE3_CTX *, const void *, size_t);
+void BLAKE3Final(unsigned char[static BLAKE3_DIGEST_LENGTH], BLAKE3_CTX *);
+
+#endif /* _BLAKE3_H_ */
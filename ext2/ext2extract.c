@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdnoreturn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "ext2fs.h"
+
+/* Maximum number of runs that a file is described with at a time. */
+#define RUNS_MAX 64
+
+/* Limits of numeric options: buffers in the cache and worker threads. */
+#define MAX_NBUFS (1L << 24)
+#define MAX_THREADS 256L
+
+/*
+ * Extracts the whole filesystem into a directory on the host. Contents of
+ * regular files are never read into user space: each run of blocks that is
+ * consecutive in the image is copied by the kernel with `copy_file_range`
+ * (or `sendfile` if the former does not work between the two filesystems),
+ * and holes are left unwritten, so they stay holes in the copy.
+ *
+ * Directories are processed by a pool of threads. Each directory is a work
+ * item: a thread creates all its entries, queues subdirectories and finally
+ * sets the directory mode and times, as nothing is added to it later.
+ */
+
+typedef struct work {
+  struct work *w_next; /* next item on the stack */
+  uint32_t w_ino;      /* i-node number of the directory */
+  char w_path[];       /* host path of the directory */
+} work_t;
+
+static pthread_mutex_t wlock; /* protects all below */
+static pthread_cond_t wcv;    /* signalled when there is work or all done */
+static work_t *stack;         /* directories waiting to be extracted */
+static size_t nbusy;          /* threads extracting a directory */
+
+static bool failed;       /* set if any file could not be extracted */
+static bool use_cfr = true; /* is `copy_file_range` usable? (atomic) */
+
+static void warn_error(const char *path, int error) {
+  fprintf(stderr, "%s: %s\n", path, strerror(error));
+  __atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+}
+
+static void work_push(const char *path, uint32_t ino) {
+  size_t len = strlen(path);
+  work_t *w = malloc(sizeof(work_t) + len + 1);
+  if (!w) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  w->w_ino = ino;
+  memcpy(w->w_path, path, len + 1);
+
+  pthread_mutex_lock(&wlock);
+  w->w_next = stack;
+  stack = w;
+  pthread_cond_signal(&wcv);
+  pthread_mutex_unlock(&wlock);
+}
+
+/* Takes next directory to extract. Returns NULL when the stack is empty and
+ * no thread can push more work, i.e. the whole tree was extracted. */
+static work_t *work_pop(void) {
+  work_t *w;
+
+  pthread_mutex_lock(&wlock);
+  while (!(w = stack) && nbusy > 0)
+    pthread_cond_wait(&wcv, &wlock);
+  if (w) {
+    stack = w->w_next;
+    nbusy++;
+  } else {
+    pthread_cond_broadcast(&wcv);
+  }
+  pthread_mutex_unlock(&wlock);
+  return w;
+}
+
+static void work_done(work_t *w) {
+  pthread_mutex_lock(&wlock);
+  if (--nbusy == 0 && stack == NULL)
+    pthread_cond_broadcast(&wcv);
+  pthread_mutex_unlock(&wlock);
+  free(w);
+}
+
+/* Copies `len` bytes from `src` offset of the image to `dst` offset of `fd`
+ * file. Returns 0 on success or error number. */
+static int copy_run(int fd, off_t src, off_t dst, size_t len) {
+  int imgfd = ext2_image_fd();
+
+  while (len > 0) {
+    ssize_t n;
+
+    if (__atomic_load_n(&use_cfr, __ATOMIC_RELAXED)) {
+      n = copy_file_range(imgfd, &src, fd, &dst, len, 0);
+      /* Older kernels cannot copy between different filesystems. */
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP)) {
+        __atomic_store_n(&use_cfr, false, __ATOMIC_RELAXED);
+        continue;
+      }
+    } else {
+      if (lseek(fd, dst, SEEK_SET) < 0)
+        return errno;
+      if ((n = sendfile(fd, imgfd, &src, len)) > 0)
+        dst += n;
+    }
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return errno;
+    /* The image is shorter than the block map says. */
+    if (n == 0)
+      return EIO;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Copies data runs of `f` file that is `size` bytes long into `fd`. */
+static int copy_file(ext2_file_t *f, int fd, size_t size) {
+  ext2_run_t runs[RUNS_MAX];
+  size_t pos = 0;
+  int error;
+
+  while (pos < size) {
+    int nruns = RUNS_MAX;
+    size_t count;
+
+    if ((error = ext2_file_runs(f, pos, size - pos, runs, &nruns, &count)))
+      return error;
+    if (count == 0)
+      return EINVAL;
+
+    for (int i = 0; i < nruns; i++) {
+      if (runs[i].r_off >= 0 &&
+          (error = copy_run(fd, runs[i].r_off, pos, runs[i].r_len)))
+        return error;
+      pos += runs[i].r_len;
+    }
+  }
+
+  /* Sets the size even if the file ends with a hole. */
+  if (ftruncate(fd, size))
+    return errno;
+  return 0;
+}
+
+static void extract_file(const char *path, uint32_t ino, struct stat *st) {
+  ext2_file_t *f;
+  int error;
+
+  if ((error = ext2_open(ino, &f))) {
+    warn_error(path, error);
+    return;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    warn_error(path, errno);
+  } else {
+    if ((error = copy_file(f, fd, st->st_size)))
+      warn_error(path, error);
+    else if (fchmod(fd, st->st_mode & 07777) ||
+             futimens(fd, (struct timespec[2]){st->st_atim, st->st_mtim}))
+      warn_error(path, errno);
+    close(fd);
+  }
+
+  ext2_close(f);
+}
+
+static void extract_symlink(const char *path, uint32_t ino, struct stat *st) {
+  char target[st->st_size + 1];
+  int error;
+
+  if ((error = ext2_readlink(ino, target, st->st_size))) {
+    warn_error(path, error);
+    return;
+  }
+  target[st->st_size] = '\0';
+
+  if (symlink(target, path) ||
+      utimensat(AT_FDCWD, path, (struct timespec[2]){st->st_atim, st->st_mtim},
+                AT_SYMLINK_NOFOLLOW))
+    warn_error(path, errno);
+}
+
+/* Creates entry `name` of directory `dirpath`. Subdirectories are queued. */
+static void extract_entry(const char *dirpath, const char *name,
+                          size_t namelen, uint32_t ino) {
+  char path[strlen(dirpath) + namelen + 2];
+  sprintf(path, "%s/%.*s", dirpath, (int)namelen, name);
+
+  struct stat st;
+  int error;
+
+  memset(&st, 0, sizeof(st));
+  if ((error = ext2_stat(ino, &st))) {
+    warn_error(path, error);
+    return;
+  }
+
+  switch (st.st_mode & S_IFMT) {
+    case S_IFDIR:
+      /* The mode is set once all entries are created. */
+      if (mkdir(path, 0700) && errno != EEXIST)
+        warn_error(path, errno);
+      else
+        work_push(path, ino);
+      break;
+    case S_IFREG:
+      extract_file(path, ino, &st);
+      break;
+    case S_IFLNK:
+      extract_symlink(path, ino, &st);
+      break;
+    case S_IFIFO:
+      if (mkfifo(path, st.st_mode & 07777))
+        warn_error(path, errno);
+      break;
+    default:
+      /* Device numbers are not exported by `ext2_stat`. */
+      warn_error(path, ENOTSUP);
+      break;
+  }
+}
+
+static void extract_dir(work_t *w) {
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+  struct stat st;
+  int error;
+
+  memset(&st, 0, sizeof(st));
+  if ((error = ext2_stat(w->w_ino, &st)) ||
+      (error = ext2_dir_open(w->w_ino, 0, &dir))) {
+    warn_error(w->w_path, error);
+    return;
+  }
+
+  while (ext2_dir_next(&dir, &dv)) {
+    if (dv.dv_namelen == 1 && dv.dv_name[0] == '.')
+      continue;
+    if (dv.dv_namelen == 2 && dv.dv_name[0] == '.' && dv.dv_name[1] == '.')
+      continue;
+    extract_entry(w->w_path, dv.dv_name, dv.dv_namelen, dv.dv_ino);
+  }
+
+  ext2_dir_close(&dir);
+
+  if (chmod(w->w_path, st.st_mode & 07777) ||
+      utimensat(AT_FDCWD, w->w_path,
+                (struct timespec[2]){st.st_atim, st.st_mtim}, 0))
+    warn_error(w->w_path, errno);
+}
+
+static void *worker_main(void *arg __unused) {
+  work_t *w;
+
+  while ((w = work_pop())) {
+    extract_dir(w);
+    work_done(w);
+  }
+
+  return NULL;
+}
+
+static void extract(const char *destdir, size_t nthreads) {
+  pthread_t threads[nthreads];
+
+  pthread_mutex_init(&wlock, NULL);
+  pthread_cond_init(&wcv, NULL);
+
+  if (mkdir(destdir, 0700) && errno != EEXIST) {
+    perror(destdir);
+    exit(EXIT_FAILURE);
+  }
+
+  work_push(destdir, EXT2_ROOTINO);
+
+  /* The main thread is one of the workers. */
+  for (size_t i = 1; i < nthreads; i++) {
+    if ((errno = pthread_create(&threads[i], NULL, worker_main, NULL))) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  worker_main(NULL);
+
+  for (size_t i = 1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_cond_destroy(&wcv);
+  pthread_mutex_destroy(&wlock);
+}
+
+static noreturn void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-c nbufs] [-j nthreads] [-i image] destdir\n",
+          prog);
+  fprintf(stderr, "  -c  number of block buffers in the cache\n");
+  fprintf(stderr, "  -j  number of threads extracting directories\n");
+  fprintf(stderr, "  -i  filesystem image (debian9-ext2.img by default)\n");
+  exit(EXIT_FAILURE);
+}
+
+/* Parses `arg` of an option as a decimal number from `lo` to `hi`. */
+static long parse_number(const char *prog, const char *arg, long lo,
+                         long hi) {
+  char *end;
+  errno = 0;
+  long val = strtol(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || val < lo || val > hi) {
+    fprintf(stderr, "%s: '%s' is not a number from %ld to %ld\n", prog, arg,
+            lo, hi);
+    usage(prog);
+  }
+  return val;
+}
+
+int main(int argc, char *argv[]) {
+  ext2_mntopts_t opts = {.flags = 0, .nbufs = 0, .ninodes = 0};
+  const char *image = "debian9-ext2.img";
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int ch, error;
+
+  while ((ch = getopt(argc, argv, "c:j:i:")) != -1) {
+    switch (ch) {
+      case 'c':
+        opts.nbufs = parse_number(argv[0], optarg, 0, MAX_NBUFS);
+        break;
+      case 'j':
+        nthreads = parse_number(argv[0], optarg, 1, MAX_THREADS);
+        break;
+      case 'i':
+        image = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind + 1 != argc)
+    usage(argv[0]);
+
+  if ((error = ext2_mount_opts(image, &opts))) {
+    fprintf(stderr, "Cannot open '%s': %s!\n", image, strerror(error));
+    exit(EXIT_FAILURE);
+  }
+
+  extract(argv[optind], min(max(nthreads, 1L), MAX_THREADS));
+  exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
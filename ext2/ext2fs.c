@@ -9,6 +9,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdalign.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -17,6 +18,11 @@
 #include <stdnoreturn.h>
 #include <string.h>
 #include <unistd.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 #include "ext2fs_defs.h"
 #include "ext2fs.h"
@@ -40,26 +46,34 @@ static noreturn void panic(const char *fmt, ...) {
   exit(EXIT_FAILURE);
 }
 
-/* Number of lists containing buffered blocks. */
-#define NBUCKETS 16
-
-/* Since majority of files in a filesystem are small, `idx` values will be
- * usually low. Since ext2fs tends to allocate blocks at the beginning of each
- * block group, `ino` values are less predictable. */
-#define BUCKET(ino, idx) (((ino) + (idx)) % NBUCKETS)
-
-/* That should give us around 64kB worth of buffers. */
-#define NBLOCKS (NBUCKETS * 4)
-
-/* Structure that is used to manage buffer of single block. */
+/* Default number of block buffers, i.e. 1MiB worth of buffers. */
+#define NBLOCKS 1024
+
+/* Buffer cache is split into shards, each with its own lock, hash table and
+ * replacement queues, so that concurrent readers rarely contend for a lock.
+ * Shard is selected by block address. Each shard should hold at least
+ * SHARD_MINBLOCKS buffers, hence small caches use fewer shards. */
+#define NSHARDS 16
+#define SHARD_MINBLOCKS 32
+
+/* Buffer cache uses simplified 2Q replacement policy (Johnson & Shasha, 1994).
+ * A block seen for the first time is put on `a1inlst` FIFO queue. When it gets
+ * evicted from there, only its identity is remembered on `a1outlst` ghost
+ * queue. A block that is requested again while being a ghost is considered
+ * hot and it's put on `amlst`, which is managed as LRU. Thus a single scan
+ * over a large file cannot flush out frequently used blocks. */
+typedef enum { Q_FREE, Q_A1IN, Q_A1OUT, Q_AM } blk_queue_t;
+
+/* Structure that is used to manage buffer of single block. All fields are
+ * protected by the lock of shard the buffer belongs to. */
 typedef struct blk {
-  TAILQ_ENTRY(blk) b_hash;
   TAILQ_ENTRY(blk) b_link;
-  uint32_t b_blkaddr; /* block address on the block device */
-  uint32_t b_inode;   /* i-node number of file this buffer refers to */
-  uint32_t b_index;   /* block index from the beginning of file */
-  uint32_t b_refcnt;  /* if zero then block can be reused */
-  void *b_data;       /* raw data from this buffer */
+  uint32_t b_blkaddr;  /* block address on the block device */
+  uint32_t b_refcnt;   /* if zero then block can be reused */
+  uint32_t b_slot;     /* position in hash table of the shard */
+  blk_queue_t b_queue; /* replacement queue the buffer is on */
+  bool b_busy;         /* data is being read in from the image */
+  void *b_data;        /* raw data from this buffer (NULL for ghosts) */
 } blk_t;
 
 typedef TAILQ_HEAD(blk_list, blk) blk_list_t;
@@ -68,22 +82,265 @@ typedef TAILQ_HEAD(blk_list, blk) blk_list_t;
  * represent a block filled with zeros. You must not dereference the value! */
 #define BLK_ZERO ((blk_t *)-1L)
 
-/* All memory for buffers and buffer management is allocated statically.
- * Using malloc for these would introduce unnecessary complexity. */
-static alignas(BLKSIZE) char blkdata[NBLOCKS][BLKSIZE];
-static blk_t blocks[NBLOCKS];
-static blk_list_t buckets[NBUCKETS]; /* all blocks with valid data */
-static blk_list_t lrulst;            /* free blocks with valid data */
-static blk_list_t freelst;           /* free blocks that are empty */
+/* Part of buffer cache. Hash table is open-addressing (with linear probing)
+ * and it contains all buffers with valid data and all ghosts. Its size is a
+ * power of two and is at least twice the number of entries, so probe sequences
+ * are kept short. */
+typedef struct blkshard {
+  pthread_mutex_t bs_lock;
+  pthread_cond_t bs_cv;  /* signalled when I/O completes or buffer is freed */
+  size_t bs_waiting;     /* number of threads waiting for free buffer */
+  blk_t **bs_tab;        /* hash table */
+  size_t bs_mask;        /* size of `bs_tab` minus one */
+  size_t bs_a1in_max;    /* desired maximum length of `bs_a1in` */
+  size_t bs_a1in_len;    /* current length of `bs_a1in` */
+  blk_list_t bs_a1in;    /* blocks referenced once, FIFO order */
+  blk_list_t bs_am;      /* blocks referenced many times, LRU order */
+  blk_list_t bs_a1out;   /* ghosts of blocks evicted from `bs_a1in` */
+  blk_list_t bs_free;    /* free blocks that are empty */
+  blk_list_t bs_ghosts;  /* unused ghost entries */
+} blkshard_t;
+
+/* Memory for buffers and buffer management is allocated when filesystem is
+ * mounted, since the number of buffers is configurable. */
+static char *blkdata;
+static blk_t *blocks;      /* `nblocks` buffers followed by `nghosts` ghosts */
+static size_t nblocks;     /* number of buffers that hold data */
+static size_t nghosts;     /* number of ghost entries */
+static blkshard_t *shards;
+static size_t nshards;     /* power of two */
+
+/* Blocks that will be needed soon (e.g. indirect blocks) are read into the
+ * cache at most FETCH_MAX at a time, and no more than `fetch_max` when the
+ * cache is small. */
+#define FETCH_MAX 64
+static size_t fetch_max;
+
+/* Buffers are identified by physical block address, so that all hard links to
+ * a file, as well as metadata and data, share single cached copy of a block.
+ * Translation from file block index to block address is cached separately in
+ * a direct-mapped table. Thus a hit in both caches does not need to touch
+ * the i-node table nor indirect blocks. */
+typedef struct blkmap {
+  uint32_t m_seq;     /* sequence number (see `seqlock_read_begin`) */
+  uint32_t m_inode;   /* i-node number (0 if the entry is empty) */
+  uint32_t m_index;   /* block index from the beginning of file */
+  uint32_t m_blkaddr; /* block address on the block device (0 for holes) */
+} blkmap_t;
+
+static blkmap_t *blkmaps;
+static size_t blkmaps_mask;
+
+/* Default number of i-nodes kept in memory. */
+#define NINODES 1024
+
+/* Readahead window starts at RA_MIN blocks and it's doubled up to `ra_max`
+ * blocks (RA_MAX by default) as long as the file is read sequentially. */
+#define RA_MIN 4U
+#define RA_MAX 256U
+
+/* Readers without a file handle share readahead state of the i-node. It has
+ * a few streams, so that interleaved sequential readers of the same file do
+ * not keep resetting each other's window. */
+#define RA_STREAMS 4
+
+static size_t ra_max; /* zero if readahead is disabled */
+
+/* Readahead state of a stream of reads. */
+typedef struct rastate {
+  size_t ra_pos;      /* where the last read ended */
+  uint32_t ra_end;    /* first block not yet read ahead */
+  uint32_t ra_window; /* current readahead window in blocks */
+} rastate_t;
+
+/* Run of consecutive file blocks that are also consecutive on the block
+ * device. Holes are described by runs with zero block address. */
+typedef struct extent {
+  uint32_t e_index;   /* block index of the first block in the run */
+  uint32_t e_blkaddr; /* block address of the first block (0 for holes) */
+  uint32_t e_count;   /* number of blocks in the run */
+} extent_t;
+
+/* Structure that is used to keep decoded i-node in memory. Contents of
+ * referenced entry do not change, so they can be accessed without locking.
+ * Block map is decoded on first use and it's kept until entry is reused. */
+typedef struct icache {
+  TAILQ_ENTRY(icache) ic_hash; /* entry on hash chain */
+  TAILQ_ENTRY(icache) ic_link; /* entry on LRU or free list */
+  uint32_t ic_ino;             /* i-node number */
+  uint32_t ic_refcnt;          /* if zero then entry can be reused */
+  bool ic_loading;             /* i-node is being read in */
+  bool ic_mapping;             /* block map is being decoded */
+  bool ic_used;                /* is the i-node allocated? */
+  uint32_t ic_nextents;        /* number of entries in `ic_extents` */
+  extent_t *ic_extents;        /* block map sorted by block index */
+  pthread_mutex_t ic_ralock;   /* protects `ic_ra` */
+  rastate_t ic_ra[RA_STREAMS]; /* readahead state of `ext2_read` callers */
+  ext2_inode_t ic_inode;       /* i-node contents (valid if allocated) */
+} icache_t;
+
+typedef TAILQ_HEAD(icache_list, icache) icache_list_t;
+
+static icache_t *icache;
+static size_t ninodes;
+static icache_list_t *ibuckets; /* all entries with valid data */
+static size_t ibuckets_mask;
+static icache_list_t ilrulst;   /* unreferenced entries with valid data */
+static icache_list_t ifreelst;  /* entries that are empty */
+static pthread_mutex_t ilock;   /* protects all of the above */
+static pthread_cond_t icv;      /* signalled when entry is read in or freed */
+
+/* Number of entries in directory entry cache per cached i-node. */
+#define DENTRIES_PER_INODE 4
+
+/* Only names of that length are stored in directory entry cache. Lookups of
+ * longer names are served by directory index. */
+#define DNAME_INLINE_LEN 39
+
+/* Directory entry cache maps (parent i-node, name) pairs to i-node numbers.
+ * It's direct-mapped, so each lookup does a single probe. It also remembers
+ * names that do not exist, which are represented by zero `d_ino`. */
+typedef struct dentry {
+  uint32_t d_seq;                     /* see `seqlock_read_begin` */
+  uint32_t d_parent;                  /* directory i-node (0 if unused) */
+  uint32_t d_hash;                    /* hash value of `d_name` */
+  uint32_t d_ino;                     /* i-node number or 0 if no entry */
+  uint8_t d_type;                     /* file type */
+  uint8_t d_namelen;                  /* length of `d_name` */
+  char d_name[DNAME_INLINE_LEN + 1];  /* entry name */
+} dentry_t;
+
+/* Entries are copied word by word (see `seqlock_copy`). */
+_Static_assert(sizeof(dentry_t) % sizeof(uint32_t) == 0,
+               "dentry_t must be a whole number of words");
+
+static dentry_t *dentries;
+static size_t dentries_mask;
+
+/* Maximum number of directories that have index built. */
+#define NDIRINDEX 64
+
+/* Entry of directory index hash table. */
+typedef struct dxent {
+  uint32_t dx_hash;    /* hash value of the name */
+  uint32_t dx_ino;     /* i-node number (0 if the slot is empty) */
+  uint32_t dx_nameoff; /* offset of name in `dx_names` */
+  uint8_t dx_namelen;  /* length of the name */
+  uint8_t dx_type;     /* file type */
+} dxent_t;
+
+/* Whole directory contents hashed by entry name. It's built on first lookup
+ * in a directory, so subsequent lookups take constant time regardless of
+ * directory size. Indices are reclaimed in LRU order. */
+typedef struct dirindex {
+  TAILQ_ENTRY(dirindex) dx_link;
+  uint32_t dx_ino;    /* directory i-node number (0 if unused) */
+  uint32_t dx_refcnt; /* if zero then index can be replaced */
+  bool dx_building;   /* index is being built */
+  size_t dx_mask;     /* size of `dx_table` minus one */
+  dxent_t *dx_table;  /* open-addressing hash table of entries */
+  char *dx_names;     /* storage for entry names */
+} dirindex_t;
+
+typedef TAILQ_HEAD(dirindex_list, dirindex) dirindex_list_t;
+
+static dirindex_t dirindex[NDIRINDEX];
+static dirindex_list_t dxlrulst; /* directory indices in LRU order */
+static pthread_mutex_t dxlock;   /* protects directory indices */
+static pthread_cond_t dxcv;      /* signalled when index is built or freed */
+
+/* Hash tree of a directory is used for lookups only if the filesystem has
+ * dir_index feature, since otherwise the flag may be stale. */
+static bool dx_enabled;
+static uint32_t dx_seed[4]; /* hash seed from superblock */
+static uint8_t dx_unsigned; /* added to hash version if chars are unsigned */
+
+/* Metadata index is a file that is kept next to the image and describes
+ * all allocated i-nodes, their block maps and directory entries. It has no
+ * pointers, so it's mapped into memory and used as is. If it's loaded, then
+ * i-nodes and names are looked up in the index and the image is read only
+ * for file contents. The index is tied to the image by its size, modification
+ * time and superblock hash, and it's ignored if any of them changes. */
+#define IX_MAGIC 0x78643265 /* "e2dx" */
+#define IX_VERSION 1
+
+typedef struct ixhdr {
+  uint32_t ih_magic;     /* IX_MAGIC */
+  uint32_t ih_version;   /* IX_VERSION */
+  uint64_t ih_imgsize;   /* size of the image in bytes */
+  uint64_t ih_imgmtime;  /* modification time of the image in nanoseconds */
+  uint32_t ih_sbhash;    /* hash value of the superblock */
+  uint32_t ih_ninodes;   /* number of entries in i-node section */
+  uint32_t ih_nextents;  /* number of entries in block map section */
+  uint32_t ih_ndents;    /* number of entries in directory entry section */
+  uint64_t ih_namesz;    /* size of name section in bytes */
+  uint64_t ih_inodes;    /* offsets of sections from the start of file */
+  uint64_t ih_extents;
+  uint64_t ih_dents;
+  uint64_t ih_names;
+} ixhdr_t;
+
+/* Flags of i-node entries. */
+#define IX_NOMAP 1   /* block map could not be decoded, so it's not stored */
+#define IX_NODENTS 2 /* directory could not be read, so entries are missing */
+
+/* I-node entries are sorted by i-node number. */
+typedef struct ixinode {
+  uint32_t ii_ino;       /* i-node number */
+  uint32_t ii_flags;     /* any combination of IX_* flags */
+  uint32_t ii_extent;    /* first entry of block map section */
+  uint32_t ii_nextents;  /* number of block map entries */
+  ext2_inode_t ii_inode; /* i-node contents */
+} ixinode_t;
+
+/* Directory entries are sorted by parent i-node number and name hash. */
+typedef struct ixdent {
+  uint32_t id_parent;  /* directory i-node number */
+  uint32_t id_hash;    /* hash value of the name */
+  uint32_t id_ino;     /* i-node number */
+  uint32_t id_nameoff; /* offset of name in name section */
+  uint8_t id_namelen;  /* length of the name */
+  uint8_t id_type;     /* file type */
+  uint8_t id_pad[2];
+} ixdent_t;
+
+static ixhdr_t ixkey;          /* image key, whole header once index is loaded */
+static void *ix_map;           /* loaded index or NULL */
+static size_t ix_size;         /* size of `ix_map` */
+static const ixinode_t *ix_inodes;
+static const extent_t *ix_extents;
+static const ixdent_t *ix_dents;
+static const char *ix_names;
+
+/* Cache statistics. Counters are updated concurrently by many threads. */
+static ext2_stats_t stats;
+
+#define STAT_INC(field) __atomic_fetch_add(&stats.field, 1, __ATOMIC_RELAXED)
 
 /* File descriptor that refers to ext2 filesystem image. */
 static int fd_ext2 = -1;
 
+/* If the image was mounted with EXT2_MNT_MMAP flag, then it is mapped
+ * read-only into memory and buffers point directly into the mapping. */
+static char *img_map;
+static size_t img_size;
+
+/* Block size is read from superblock. It's a power of two from 1KiB up. */
+static size_t blksize;
+static unsigned blkshift; /* log2(blksize) */
+
+/* Converts byte offset into block number and offset within the block. */
+#define lblkno(off) ((off) >> blkshift)
+#define blkoff(off) ((off) & (blksize - 1))
+
+/* Size of i-node table entry. It may be larger than `ext2_inode_t`. */
+static size_t inode_size;
+
 /* How many i-nodes fit into one block? */
-#define BLK_INODES (BLKSIZE / sizeof(ext2_inode_t))
+#define BLK_INODES (blksize / inode_size)
 
 /* How many block pointers fit into one block? */
-#define BLK_POINTERS (BLKSIZE / sizeof(uint32_t))
+#define BLK_POINTERS (blksize / sizeof(uint32_t))
 
 /* Properties extracted from a superblock and block group descriptors. */
 static size_t inodes_per_group;      /* number of i-nodes in block group */
@@ -92,300 +349,2160 @@ static size_t group_desc_count;      /* numbre of block group descriptors */
 static size_t block_count;           /* number of blocks in the filesystem */
 static size_t inode_count;           /* number of i-nodes in the filesystem */
 static size_t first_data_block;      /* first block managed by block bitmap */
-static ext2_groupdesc_t *group_desc; /* block group descriptors in memory */
+static ext2_groupdesc_t *group_desc; /* block group descriptors (mount only) */
+
+/* Division by a value that is known at mount time. Powers of two use shift
+ * and mask, other values a precomputed reciprocal (D. Lemire, O. Kaser,
+ * N. Kurz, "Faster Remainder by Direct Computation", 2019), which is exact
+ * for 32-bit dividends. */
+typedef struct fastdiv {
+  uint64_t fd_magic;   /* ceil(2^64 / divisor), 0 for powers of two */
+  uint32_t fd_divisor; /* divisor itself */
+  uint32_t fd_shift;   /* log2(divisor) for powers of two */
+} fastdiv_t;
+
+static fastdiv_t bpg_div; /* divides by `blocks_per_group` */
+static fastdiv_t ipg_div; /* divides by `inodes_per_group` */
+
+/* Summary of a group bitmap. Number of bits in use and the first one in use
+ * are computed from the bitmap when needed for the first time. The image is
+ * never modified, so they stay valid. */
+#define GRPMAP_UNKNOWN UINT32_MAX
+
+typedef struct grpmap {
+  uint32_t gm_bitmap; /* bitmap block address */
+  uint32_t gm_nbits;  /* number of valid bits in the bitmap */
+  uint32_t gm_used;   /* number of bits set (or GRPMAP_UNKNOWN) */
+  uint32_t gm_first;  /* first bit set (`gm_nbits` if none) */
+} grpmap_t;
+
+/* Block group summary built at mount time from group descriptors. */
+typedef struct group {
+  grpmap_t g_blocks;   /* block bitmap summary */
+  grpmap_t g_inodes;   /* i-node bitmap summary */
+  uint32_t g_i_tables; /* first i-node table block */
+  uint16_t g_nbfree;   /* free blocks according to descriptor */
+  uint16_t g_nifree;   /* free i-nodes according to descriptor */
+} group_t;
+
+static group_t *groups;
 
 /*
  * Buffering routines.
  */
 
-/* Opens filesystem image file and initializes block buffers. */
-static int blk_init(const char *fspath) {
+/* Maps the whole filesystem image into memory. Kernel is told about expected
+ * access pattern, so it can tune its readahead accordingly. */
+static int blk_map(unsigned flags) {
+  struct stat st;
+  if (fstat(fd_ext2, &st) < 0)
+    return errno;
+
+  img_size = st.st_size;
+  img_map = mmap(NULL, img_size, PROT_READ, MAP_SHARED, fd_ext2, 0);
+  if (img_map == MAP_FAILED) {
+    img_map = NULL;
+    return errno;
+  }
+
+  int advice = (flags & EXT2_MNT_SEQUENTIAL) ? MADV_SEQUENTIAL : MADV_RANDOM;
+  (void)madvise(img_map, img_size, advice);
+  return 0;
+}
+
+/* Opens filesystem image file. */
+static int blk_open(const char *fspath, unsigned flags) {
+  int error;
+
   if ((fd_ext2 = open(fspath, O_RDONLY)) < 0)
     return errno;
 
-  /* Initialize list structures. */
-  TAILQ_INIT(&lrulst);
-  TAILQ_INIT(&freelst);
-  for (int i = 0; i < NBUCKETS; i++)
-    TAILQ_INIT(&buckets[i]);
+  if ((flags & EXT2_MNT_MMAP) && (error = blk_map(flags)))
+    return error;
+
+  return 0;
+}
+
+/*
+ * Asynchronous I/O routines.
+ *
+ * Reads that are known in advance are submitted in batches, so the device
+ * sees them all at once instead of one after another. Each thread has its own
+ * io_uring, so submission needs no locking. If io_uring is not available, the
+ * batch is shared out to a pool of threads doing `pread`, and the submitting
+ * thread helps them.
+ */
+
+/* Read request of a batch submitted with `aio_read`. */
+typedef struct aioreq {
+  void *ar_buf;  /* destination buffer */
+  size_t ar_len; /* number of bytes to read */
+  off_t ar_off;  /* offset in the image */
+  int ar_error;  /* 0 or error number on completion */
+} aioreq_t;
+
+/* How many requests are in flight at most? */
+#define AIO_DEPTH 64
+
+/* Number of threads that serve requests if there's no io_uring. */
+#define AIO_THREADS 8
+
+typedef struct uring {
+  int ur_fd;                    /* io_uring instance */
+  unsigned ur_entries;          /* number of submission queue entries */
+  unsigned *ur_sqtail;          /* submission queue (written by us) */
+  unsigned *ur_sqmask;
+  unsigned *ur_sqarray;
+  struct io_uring_sqe *ur_sqes;
+  unsigned *ur_cqhead;          /* completion queue (head written by us) */
+  unsigned *ur_cqtail;
+  unsigned *ur_cqmask;
+  struct io_uring_cqe *ur_cqes;
+  void *ur_sqmap;               /* mapped rings and submission entries */
+  void *ur_cqmap;
+  size_t ur_sqmapsz;
+  size_t ur_cqmapsz;
+  size_t ur_sqesz;
+} uring_t;
+
+static bool aio_sync;               /* do all reads with plain `pread` */
+static bool aio_nouring;            /* io_uring failed, use the pool */
+static pthread_key_t aio_key;       /* ring of calling thread */
+static pthread_once_t aio_key_once = PTHREAD_ONCE_INIT;
+
+/* Batch of requests served by the pool of threads. */
+typedef struct aiobatch {
+  TAILQ_ENTRY(aiobatch) ab_link;
+  aioreq_t *ab_reqs; /* requests of the batch */
+  size_t ab_n;       /* number of requests */
+  size_t ab_next;    /* next request to be taken */
+  size_t ab_left;    /* requests taken, but not completed yet */
+} aiobatch_t;
+
+static TAILQ_HEAD(, aiobatch) aioq = TAILQ_HEAD_INITIALIZER(aioq);
+static pthread_mutex_t aiolock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aiocv = PTHREAD_COND_INITIALIZER;   /* work queued */
+static pthread_cond_t aiodone = PTHREAD_COND_INITIALIZER; /* batch done */
+static pthread_once_t aio_pool_once = PTHREAD_ONCE_INIT;
+
+/* Serves request `ar` with `pread`, retrying short reads. */
+static void aio_pread(aioreq_t *ar) {
+  while (ar->ar_len > 0) {
+    ssize_t n = pread(fd_ext2, ar->ar_buf, ar->ar_len, ar->ar_off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ar->ar_error = n < 0 ? errno : EIO;
+      return;
+    }
+    ar->ar_buf += n;
+    ar->ar_off += n;
+    ar->ar_len -= n;
+  }
+}
+
+static void uring_unmap(uring_t *ur) {
+  if (ur->ur_sqes != NULL && ur->ur_sqes != MAP_FAILED)
+    munmap(ur->ur_sqes, ur->ur_sqesz);
+  if (ur->ur_cqmap != NULL && ur->ur_cqmap != MAP_FAILED &&
+      ur->ur_cqmap != ur->ur_sqmap)
+    munmap(ur->ur_cqmap, ur->ur_cqmapsz);
+  if (ur->ur_sqmap != NULL && ur->ur_sqmap != MAP_FAILED)
+    munmap(ur->ur_sqmap, ur->ur_sqmapsz);
+  close(ur->ur_fd);
+}
+
+static void uring_free(void *arg) {
+  uring_unmap(arg);
+  free(arg);
+}
+
+/* Creates io_uring instance and maps its rings. */
+static int uring_setup(uring_t *ur) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(ur, 0, sizeof(uring_t));
+
+  if ((ur->ur_fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &p)) < 0)
+    return errno;
 
-  /* Initialize all blocks and put them on free list. */
-  for (int i = 0; i < NBLOCKS; i++) {
-    blocks[i].b_data = blkdata[i];
-    TAILQ_INSERT_TAIL(&freelst, &blocks[i], b_link);
+  ur->ur_entries = p.sq_entries;
+  ur->ur_sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ur->ur_cqmapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  ur->ur_sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* Newer kernels map both rings with a single mapping. */
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    ur->ur_sqmapsz = ur->ur_cqmapsz = max(ur->ur_sqmapsz, ur->ur_cqmapsz);
+
+  int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+  ur->ur_sqmap =
+    mmap(NULL, ur->ur_sqmapsz, prot, flags, ur->ur_fd, IORING_OFF_SQ_RING);
+  ur->ur_cqmap = single ? ur->ur_sqmap
+                        : mmap(NULL, ur->ur_cqmapsz, prot, flags, ur->ur_fd,
+                               IORING_OFF_CQ_RING);
+  ur->ur_sqes =
+    mmap(NULL, ur->ur_sqesz, prot, flags, ur->ur_fd, IORING_OFF_SQES);
+
+  if (ur->ur_sqmap == MAP_FAILED || ur->ur_cqmap == MAP_FAILED ||
+      ur->ur_sqes == MAP_FAILED) {
+    int error = errno;
+    uring_unmap(ur);
+    return error;
   }
 
+  ur->ur_sqtail = ur->ur_sqmap + p.sq_off.tail;
+  ur->ur_sqmask = ur->ur_sqmap + p.sq_off.ring_mask;
+  ur->ur_sqarray = ur->ur_sqmap + p.sq_off.array;
+  ur->ur_cqhead = ur->ur_cqmap + p.cq_off.head;
+  ur->ur_cqtail = ur->ur_cqmap + p.cq_off.tail;
+  ur->ur_cqmask = ur->ur_cqmap + p.cq_off.ring_mask;
+  ur->ur_cqes = ur->ur_cqmap + p.cq_off.cqes;
   return 0;
 }
 
-/* Allocates new block buffer. */
-static blk_t *blk_alloc(void) {
-  blk_t *blk = NULL;
+static void aio_key_init(void) {
+  pthread_key_create(&aio_key, uring_free);
+}
 
-  /* Initially every empty block is on free list. */
-  if (!TAILQ_EMPTY(&freelst)) {
-#ifdef STUDENT
-    /* TODO */
-    blk = TAILQ_FIRST(&freelst);
-    TAILQ_REMOVE(&freelst, blk, b_link);
-#endif /* !STUDENT */
+/* Returns io_uring of calling thread, creating it on first use, or NULL if
+ * io_uring is not available. */
+static uring_t *uring_get(void) {
+  if (__atomic_load_n(&aio_nouring, __ATOMIC_RELAXED))
+    return NULL;
+
+  pthread_once(&aio_key_once, aio_key_init);
+
+  uring_t *ur = pthread_getspecific(aio_key);
+  if (ur != NULL)
+    return ur;
+
+  if (!(ur = malloc(sizeof(uring_t))) || uring_setup(ur)) {
+    __atomic_store_n(&aio_nouring, true, __ATOMIC_RELAXED);
+    free(ur);
+    return NULL;
+  }
+
+  pthread_setspecific(aio_key, ur);
+  return ur;
+}
+
+/* Serves `n` requests from `reqs` with io_uring `ur`, keeping the submission
+ * queue full until all requests are submitted. */
+static void uring_read(uring_t *ur, aioreq_t *reqs, size_t n) {
+  size_t next = 0, inflight = 0, done = 0;
+  unsigned unsubmitted = 0;
+
+  while (done < n) {
+    unsigned tail = *ur->ur_sqtail;
+    while (next < n && inflight < ur->ur_entries) {
+      unsigned idx = tail & *ur->ur_sqmask;
+      struct io_uring_sqe *sqe = &ur->ur_sqes[idx];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = fd_ext2;
+      sqe->addr = (uintptr_t)reqs[next].ar_buf;
+      sqe->len = reqs[next].ar_len;
+      sqe->off = reqs[next].ar_off;
+      sqe->user_data = next;
+      ur->ur_sqarray[idx] = idx;
+      tail++, next++, inflight++, unsubmitted++;
+    }
+    __atomic_store_n(ur->ur_sqtail, tail, __ATOMIC_RELEASE);
+
+    int ret = syscall(__NR_io_uring_enter, ur->ur_fd, unsubmitted, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      panic("io_uring_enter: %s", strerror(errno));
+    if (ret > 0)
+      unsubmitted -= ret;
+
+    unsigned head = *ur->ur_cqhead;
+    unsigned ctail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+    for (; head != ctail; head++, inflight--, done++) {
+      struct io_uring_cqe *cqe = &ur->ur_cqes[head & *ur->ur_cqmask];
+      aioreq_t *ar = &reqs[cqe->user_data];
+      if (cqe->res >= 0) {
+        ar->ar_buf += cqe->res;
+        ar->ar_off += cqe->res;
+        ar->ar_len -= cqe->res;
+      }
+      /* Short reads and kernels without IORING_OP_READ are served by hand. */
+      if (cqe->res == 0 && ar->ar_len > 0)
+        ar->ar_error = EIO;
+      else if (cqe->res >= 0 || cqe->res == -EINVAL || cqe->res == -EAGAIN ||
+               cqe->res == -EOPNOTSUPP)
+        aio_pread(ar);
+      else
+        ar->ar_error = -cqe->res;
+    }
+    __atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+  }
+}
+
+/* Takes next request of the first queued batch. Must be called with
+ * `aiolock` and the queue must not be empty. */
+static aioreq_t *aio_take(aiobatch_t **abp) {
+  aiobatch_t *ab = TAILQ_FIRST(&aioq);
+  aioreq_t *ar = &ab->ab_reqs[ab->ab_next++];
+  ab->ab_left++;
+  if (ab->ab_next == ab->ab_n)
+    TAILQ_REMOVE(&aioq, ab, ab_link);
+  *abp = ab;
+  return ar;
+}
+
+/* Completes request taken from `ab`. Must be called with `aiolock`. */
+static void aio_complete(aiobatch_t *ab) {
+  if (--ab->ab_left == 0 && ab->ab_next == ab->ab_n)
+    pthread_cond_broadcast(&aiodone);
+}
+
+static void *aio_worker(void *arg __unused) {
+  pthread_mutex_lock(&aiolock);
+  for (;;) {
+    while (TAILQ_EMPTY(&aioq))
+      pthread_cond_wait(&aiocv, &aiolock);
+    aiobatch_t *ab;
+    aioreq_t *ar = aio_take(&ab);
+    pthread_mutex_unlock(&aiolock);
+    aio_pread(ar);
+    pthread_mutex_lock(&aiolock);
+    aio_complete(ab);
+  }
+  return NULL;
+}
+
+/* Starts the pool. Threads that could not be started are not missed, since
+ * the submitting thread serves its own batch too. */
+static void aio_pool_init(void) {
+  for (int i = 0; i < AIO_THREADS; i++) {
+    pthread_t td;
+    if (pthread_create(&td, NULL, aio_worker, NULL))
+      break;
+    pthread_detach(td);
+  }
+}
+
+/* Serves `n` requests from `reqs` with the pool of threads. */
+static void pool_read(aioreq_t *reqs, size_t n) {
+  aiobatch_t batch = {.ab_reqs = reqs, .ab_n = n};
+
+  pthread_once(&aio_pool_once, aio_pool_init);
+
+  pthread_mutex_lock(&aiolock);
+  TAILQ_INSERT_TAIL(&aioq, &batch, ab_link);
+  pthread_cond_broadcast(&aiocv);
+
+  /* Help the pool with our own batch, then wait for the stragglers. */
+  while (batch.ab_next < batch.ab_n) {
+    aiobatch_t *ab;
+    aioreq_t *ar;
+    TAILQ_REMOVE(&aioq, &batch, ab_link);
+    TAILQ_INSERT_HEAD(&aioq, &batch, ab_link);
+    ar = aio_take(&ab);
+    pthread_mutex_unlock(&aiolock);
+    aio_pread(ar);
+    pthread_mutex_lock(&aiolock);
+    aio_complete(ab);
+  }
+  while (batch.ab_left > 0)
+    pthread_cond_wait(&aiodone, &aiolock);
+  pthread_mutex_unlock(&aiolock);
+}
+
+/* Reads data for all `n` requests of `reqs` and waits until it's done.
+ * Returns 0 on success or error of the first request that failed. */
+static int aio_read(aioreq_t *reqs, size_t n) {
+  uring_t *ur;
+
+  for (size_t i = 0; i < n; i++)
+    reqs[i].ar_error = 0;
+
+  if (n <= 1 || aio_sync) {
+    for (size_t i = 0; i < n; i++)
+      aio_pread(&reqs[i]);
+  } else {
+    STAT_INC(aio_batches);
+    __atomic_fetch_add(&stats.aio_reqs, n, __ATOMIC_RELAXED);
+    if ((ur = uring_get()))
+      uring_read(ur, reqs, n);
+    else
+      pool_read(reqs, n);
+  }
+
+  for (size_t i = 0; i < n; i++)
+    if (reqs[i].ar_error)
+      return reqs[i].ar_error;
+  return 0;
+}
+
+/* Mixes two 32-bit values into a hash value. This is the final() step of Bob
+ * Jenkins' lookup3 hash, i.e. what hashword() does for a two-word key. */
+static inline uint32_t hash2(uint32_t a, uint32_t b) {
+#define rot(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
+  uint32_t c = 0xdeadbeef + (2 << 2);
+  a += c;
+  b += c;
+  c ^= b, c -= rot(b, 14);
+  a ^= c, a -= rot(c, 11);
+  b ^= a, b -= rot(a, 25);
+  c ^= b, c -= rot(b, 16);
+  a ^= c, a -= rot(c, 4);
+  b ^= a, b -= rot(a, 14);
+  c ^= b, c -= rot(b, 24);
+#undef rot
+  return c;
+}
+
+/* Returns smallest power of two that is not less than `n`. */
+static size_t roundup_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+/* Sequence locks protect small direct-mapped caches, so that lookups do not
+ * take any locks. Writer makes sequence number odd for the time of update.
+ * Reader copies the entry and checks if sequence number has not changed. */
+static inline bool seqlock_read_begin(uint32_t *seqp, uint32_t *seq) {
+  *seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+  return !(*seq & 1);
+}
+
+static inline bool seqlock_read_valid(uint32_t *seqp, uint32_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seqp, __ATOMIC_RELAXED) == seq;
+}
+
+/* Returns false if another thread is updating the entry. */
+static inline bool seqlock_write_begin(uint32_t *seqp, uint32_t *seq) {
+  *seq = __atomic_load_n(seqp, __ATOMIC_RELAXED);
+  if (*seq & 1)
+    return false;
+  if (!__atomic_compare_exchange_n(seqp, seq, *seq + 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return false;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return true;
+}
+
+static inline void seqlock_write_end(uint32_t *seqp, uint32_t seq) {
+  __atomic_store_n(seqp, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Data protected by a sequence lock is accessed concurrently by readers and
+ * the writer, so it's copied in 32-bit words with relaxed atomic accesses.
+ * Both `dst` and `src` must be word aligned and `len` a multiple of 4. */
+static inline void seqlock_copy(void *dst, const void *src, size_t len) {
+  uint32_t *d = dst;
+  const uint32_t *s = src;
+  for (size_t i = 0; i < len / sizeof(uint32_t); i++)
+    __atomic_store_n(&d[i], __atomic_load_n(&s[i], __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+static inline blkshard_t *blk_shard(uint32_t blkaddr) {
+  return &shards[hash2(blkaddr, 1) & (nshards - 1)];
+}
+
+/* Finds a buffer or a ghost for block of `blkaddr` address. */
+static blk_t *blktab_find(blkshard_t *bs, uint32_t blkaddr) {
+  for (size_t i = hash2(blkaddr, 0) & bs->bs_mask;;
+       i = (i + 1) & bs->bs_mask) {
+    blk_t *blk = bs->bs_tab[i];
+    if (blk == NULL)
+      return NULL;
+    if (blk->b_blkaddr == blkaddr)
+      return blk;
+  }
+}
+
+static void blktab_insert(blkshard_t *bs, blk_t *blk) {
+  size_t i = hash2(blk->b_blkaddr, 0) & bs->bs_mask;
+  while (bs->bs_tab[i] != NULL)
+    i = (i + 1) & bs->bs_mask;
+  bs->bs_tab[i] = blk;
+  blk->b_slot = i;
+}
+
+/* Removes an entry using backward shift deletion, so the table does not need
+ * tombstones and lookups never degrade over time. */
+static void blktab_remove(blkshard_t *bs, blk_t *blk) {
+  size_t hole = blk->b_slot;
+
+  for (size_t i = (hole + 1) & bs->bs_mask; bs->bs_tab[i] != NULL;
+       i = (i + 1) & bs->bs_mask) {
+    blk_t *next = bs->bs_tab[i];
+    size_t home = hash2(next->b_blkaddr, 0) & bs->bs_mask;
+    /* Can `next` be moved to the hole without breaking its probe sequence? */
+    if (((i - home) & bs->bs_mask) >= ((i - hole) & bs->bs_mask)) {
+      bs->bs_tab[hole] = next;
+      next->b_slot = hole;
+      hole = i;
+    }
+  }
+
+  bs->bs_tab[hole] = NULL;
+}
+
+/* Returns the queue that `blk` buffer is on. */
+static blk_list_t *blk_queue(blkshard_t *bs, blk_t *blk) {
+  switch (blk->b_queue) {
+    case Q_A1IN:
+      return &bs->bs_a1in;
+    case Q_A1OUT:
+      return &bs->bs_a1out;
+    case Q_AM:
+      return &bs->bs_am;
+    default:
+      return &bs->bs_free;
+  }
+}
+
+static void blk_enqueue(blkshard_t *bs, blk_t *blk, blk_queue_t queue) {
+  blk->b_queue = queue;
+  TAILQ_INSERT_HEAD(blk_queue(bs, blk), blk, b_link);
+  if (queue == Q_A1IN)
+    bs->bs_a1in_len++;
+}
+
+static void blk_dequeue(blkshard_t *bs, blk_t *blk) {
+  TAILQ_REMOVE(blk_queue(bs, blk), blk, b_link);
+  if (blk->b_queue == Q_A1IN)
+    bs->bs_a1in_len--;
+}
+
+/* Finds least recently inserted or used buffer on `queue` that is not
+ * referenced by anyone. */
+static blk_t *blk_victim(blk_list_t *queue) {
+  blk_t *blk;
+  TAILQ_FOREACH_REVERSE(blk, queue, blk_list, b_link) {
+    if (blk->b_refcnt == 0)
+      return blk;
+  }
+  return NULL;
+}
+
+/* Drops a buffer from the cache. If it was referenced only once, then its
+ * identity is remembered as a ghost. Returns buffer ready to be reused. */
+static blk_t *blk_evict(blkshard_t *bs, blk_t *blk) {
+  STAT_INC(bc_evictions);
+  blktab_remove(bs, blk);
+  blk_dequeue(bs, blk);
+
+  if (blk->b_queue != Q_A1IN)
     return blk;
+
+  blk_t *ghost = TAILQ_FIRST(&bs->bs_ghosts);
+  if (ghost != NULL) {
+    TAILQ_REMOVE(&bs->bs_ghosts, ghost, b_link);
+  } else {
+    ghost = TAILQ_LAST(&bs->bs_a1out, blk_list);
+    blktab_remove(bs, ghost);
+    blk_dequeue(bs, ghost);
   }
 
-  /* Eventually free list will become exhausted.
-   * Then we'll take the last recently used entry from LRU list. */
-  if (!TAILQ_EMPTY(&lrulst)) {
-#ifdef STUDENT
-    /* TODO */
-    // get first block 
-    blk = TAILQ_FIRST(&lrulst);
-    TAILQ_REMOVE(&lrulst, blk, b_link);
-    TAILQ_REMOVE(&buckets[BUCKET(blk->b_inode, blk->b_index)], blk, b_hash);
+  ghost->b_blkaddr = blk->b_blkaddr;
+  blktab_insert(bs, ghost);
+  blk_enqueue(bs, ghost, Q_A1OUT);
+  return blk;
+}
 
-#endif /* !STUDENT */
+/* Initializes block buffers. */
+static int blk_init(size_t nbufs) {
+  nblocks = nbufs ? nbufs : NBLOCKS;
+  for (nshards = NSHARDS; nshards > 1; nshards /= 2) {
+    if (nblocks / nshards >= SHARD_MINBLOCKS)
+      break;
+  }
+
+  size_t shard_blocks = howmany(nblocks, nshards);
+  size_t shard_ghosts = shard_blocks / 2 + 1;
+  nblocks = shard_blocks * nshards;
+  nghosts = shard_ghosts * nshards;
+
+  blocks = calloc(nblocks + nghosts, sizeof(blk_t));
+  shards = calloc(nshards, sizeof(blkshard_t));
+  if (blocks == NULL || shards == NULL)
+    return ENOMEM;
+
+  /* With the image mapped into memory buffers will point into it. */
+  if (img_map == NULL) {
+    if (!(blkdata = aligned_alloc(blksize, nblocks * blksize)))
+      return ENOMEM;
+  }
+
+  for (size_t i = 0; i < nshards; i++) {
+    blkshard_t *bs = &shards[i];
+
+    pthread_mutex_init(&bs->bs_lock, NULL);
+    pthread_cond_init(&bs->bs_cv, NULL);
+
+    bs->bs_a1in_max = shard_blocks / 4 + 1;
+    bs->bs_mask = roundup_pow2(2 * (shard_blocks + shard_ghosts)) - 1;
+    if (!(bs->bs_tab = calloc(bs->bs_mask + 1, sizeof(blk_t *))))
+      return ENOMEM;
+
+    /* Initialize list structures. */
+    TAILQ_INIT(&bs->bs_a1in);
+    TAILQ_INIT(&bs->bs_am);
+    TAILQ_INIT(&bs->bs_a1out);
+    TAILQ_INIT(&bs->bs_free);
+    TAILQ_INIT(&bs->bs_ghosts);
+
+    /* Initialize all blocks and put them on free lists. */
+    for (size_t j = i * shard_blocks; j < (i + 1) * shard_blocks; j++) {
+      if (blkdata != NULL)
+        blocks[j].b_data = blkdata + j * blksize;
+      TAILQ_INSERT_TAIL(&bs->bs_free, &blocks[j], b_link);
+    }
+
+    blk_t *ghosts = blocks + nblocks;
+    for (size_t j = i * shard_ghosts; j < (i + 1) * shard_ghosts; j++)
+      TAILQ_INSERT_TAIL(&bs->bs_ghosts, &ghosts[j], b_link);
+  }
+
+  blkmaps_mask = roundup_pow2(4 * nblocks) - 1;
+  if (!(blkmaps = calloc(blkmaps_mask + 1, sizeof(blkmap_t))))
+    return ENOMEM;
+
+  /* Leave most buffers to the blocks that are actually being used. */
+  fetch_max = min((size_t)FETCH_MAX, nblocks / 8 + 1);
+
+  stats.bc_nbufs = nblocks;
+  return 0;
+}
+
+/* Allocates new block buffer. Returns NULL if all buffers are in use. */
+static blk_t *blk_alloc(blkshard_t *bs) {
+  blk_t *blk;
+
+  /* Initially every empty block is on free list. */
+  if ((blk = TAILQ_FIRST(&bs->bs_free))) {
+    TAILQ_REMOVE(&bs->bs_free, blk, b_link);
     return blk;
   }
 
-  /* No buffers!? Have you forgot to release some? */
-  panic("Free buffers pool exhausted!");
+  /* Eventually free list will become exhausted. Then we'll reclaim a buffer
+   * from `bs_a1in` if it grew too long, otherwise from `bs_am`. */
+  if (bs->bs_a1in_len > bs->bs_a1in_max && (blk = blk_victim(&bs->bs_a1in)))
+    return blk_evict(bs, blk);
+  if ((blk = blk_victim(&bs->bs_am)) || (blk = blk_victim(&bs->bs_a1in)))
+    return blk_evict(bs, blk);
+
+  return NULL;
 }
 
-/* Acquires a block buffer for file identified by `ino` i-node and block index
- * `idx`. When `ino` is zero the buffer refers to filesystem metadata (i.e.
- * superblock, block group descriptors, block & i-node bitmap, etc.) and `off`
- * offset is given from the start of block device. */
-static blk_t *blk_get(uint32_t ino, uint32_t idx) {
-  blk_list_t *bucket = &buckets[BUCKET(ino, idx)];
-  blk_t *blk = NULL;
+/* Acquires a block buffer for block of `blkaddr` address. If the block is
+ * not cached, then `*fillp` is set, and the caller must read the data in and
+ * call `blk_ready`. With `prefetch` set, NULL is returned instead of waiting
+ * for a buffer or if the block is already cached. */
+static blk_t *blk_lookup(uint32_t blkaddr, bool prefetch, bool *fillp) {
+  blkshard_t *bs = blk_shard(blkaddr);
+  blk_queue_t queue = Q_A1IN;
+  blk_t *blk;
 
-  /* Locate a block in the buffer and return it if found. */
-#ifdef STUDENT
-  /* TODO */
-  blk = TAILQ_FIRST(bucket);
-  while (blk != NULL) {
-    if (blk->b_inode == ino && blk->b_index == idx) {
+  *fillp = false;
+
+  pthread_mutex_lock(&bs->bs_lock);
+
+  for (;;) {
+    blk = blktab_find(bs, blkaddr);
+
+    /* Locate a block in the buffer and return it if found. */
+    if (blk != NULL && blk->b_queue != Q_A1OUT) {
+      if (prefetch) {
+        pthread_mutex_unlock(&bs->bs_lock);
+        return NULL;
+      }
+      STAT_INC(bc_hits);
+      /* Blocks on `bs_a1in` are kept in FIFO order. */
+      if (blk->b_queue == Q_AM) {
+        TAILQ_REMOVE(&bs->bs_am, blk, b_link);
+        TAILQ_INSERT_HEAD(&bs->bs_am, blk, b_link);
+      }
+      blk->b_refcnt++;
+      /* Another thread is reading the block in, wait for the data. */
+      while (blk->b_busy)
+        pthread_cond_wait(&bs->bs_cv, &bs->bs_lock);
+      pthread_mutex_unlock(&bs->bs_lock);
       return blk;
     }
-    blk = TAILQ_NEXT(blk, b_hash);
+
+    /* Ghost must be released before allocation, which may recycle it. */
+    if (blk != NULL) {
+      STAT_INC(bc_ghosthits);
+      blktab_remove(bs, blk);
+      blk_dequeue(bs, blk);
+      TAILQ_INSERT_HEAD(&bs->bs_ghosts, blk, b_link);
+      queue = Q_AM;
+    }
+
+    if ((blk = blk_alloc(bs)))
+      break;
+
+    if (prefetch) {
+      pthread_mutex_unlock(&bs->bs_lock);
+      return NULL;
+    }
+
+    /* All buffers are in use, wait for someone to release one. Meanwhile
+     * the block might be read in by another thread, hence we start over. */
+    bs->bs_waiting++;
+    pthread_cond_wait(&bs->bs_cv, &bs->bs_lock);
+    bs->bs_waiting--;
   }
-#endif /* !STUDENT */
 
-  long blkaddr = ext2_blkaddr_read(ino, idx);
-  debug("ext2_blkaddr_read(%d, %d) -> %ld\n", ino, idx, blkaddr);
-  if (blkaddr == -1)
-    return NULL;
-  if (blkaddr == 0)
-    return BLK_ZERO;
-  if (ino > 0 && !ext2_block_used(blkaddr))
-    panic("Attempt to read block %d that is not in use!", blkaddr);
+  STAT_INC(bc_misses);
 
-  blk = blk_alloc();
-  blk->b_inode = ino;
-  blk->b_index = idx;
   blk->b_blkaddr = blkaddr;
   blk->b_refcnt = 1;
+  blktab_insert(bs, blk);
+  blk_enqueue(bs, blk, queue);
+
+  if (img_map != NULL) {
+    /* No need to copy anything, just point the buffer into the image. */
+    if (((size_t)blk->b_blkaddr + 1) << blkshift > img_size)
+      panic("Attempt to read past the end of filesystem!");
+    blk->b_data = img_map + ((size_t)blk->b_blkaddr << blkshift);
+    pthread_mutex_unlock(&bs->bs_lock);
+    return blk;
+  }
+
+  /* Do not hold the lock while doing I/O. Other threads that want the block
+   * will wait until it's marked as not busy. */
+  blk->b_busy = true;
+  pthread_mutex_unlock(&bs->bs_lock);
+  *fillp = true;
+  return blk;
+}
+
+/* Marks buffer filled in after `blk_lookup` as ready to be used. */
+static void blk_ready(blk_t *blk) {
+  blkshard_t *bs = blk_shard(blk->b_blkaddr);
+
+  pthread_mutex_lock(&bs->bs_lock);
+  blk->b_busy = false;
+  pthread_cond_broadcast(&bs->bs_cv);
+  pthread_mutex_unlock(&bs->bs_lock);
+}
 
-  ssize_t nread =
-    pread(fd_ext2, blk->b_data, BLKSIZE, blk->b_blkaddr * BLKSIZE);
-  if (nread != BLKSIZE)
-    panic("Attempt to read past the end of filesystem!");
+/* Acquires a block buffer for block of `blkaddr` address. */
+static blk_t *blk_read(uint32_t blkaddr) {
+  bool fill;
+  blk_t *blk = blk_lookup(blkaddr, false, &fill);
+
+  if (fill) {
+    ssize_t nread =
+      pread(fd_ext2, blk->b_data, blksize, (off_t)blk->b_blkaddr << blkshift);
+    if (nread != (ssize_t)blksize)
+      panic("Attempt to read past the end of filesystem!");
+    blk_ready(blk);
+  }
 
-  TAILQ_INSERT_HEAD(bucket, blk, b_hash);
   return blk;
 }
 
+/* Translates block index `idx` of `ino` file to block address using the cache
+ * of recent translations. Returns -1 on failure, otherwise block address. */
+static long blk_bmap(uint32_t ino, uint32_t idx) {
+  blkmap_t *map = &blkmaps[hash2(ino, idx) & blkmaps_mask];
+  uint32_t seq;
+
+  if (seqlock_read_begin(&map->m_seq, &seq)) {
+    uint32_t m_inode = __atomic_load_n(&map->m_inode, __ATOMIC_RELAXED);
+    uint32_t m_index = __atomic_load_n(&map->m_index, __ATOMIC_RELAXED);
+    uint32_t m_blkaddr = __atomic_load_n(&map->m_blkaddr, __ATOMIC_RELAXED);
+    if (seqlock_read_valid(&map->m_seq, seq) && m_inode == ino &&
+        m_index == idx) {
+      STAT_INC(mc_hits);
+      return m_blkaddr;
+    }
+  }
+
+  STAT_INC(mc_misses);
+
+  long blkaddr = ext2_blkaddr_read(ino, idx);
+  debug("ext2_blkaddr_read(%d, %d) -> %ld\n", ino, idx, blkaddr);
+  if (blkaddr == -1)
+    return -1;
+  if (blkaddr > 0 && !ext2_block_used(blkaddr))
+    panic("Attempt to read block %ld that is not in use!", blkaddr);
+
+  /* If someone else is updating the entry, then just skip caching. */
+  if (seqlock_write_begin(&map->m_seq, &seq)) {
+    __atomic_store_n(&map->m_inode, ino, __ATOMIC_RELAXED);
+    __atomic_store_n(&map->m_index, idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&map->m_blkaddr, blkaddr, __ATOMIC_RELAXED);
+    seqlock_write_end(&map->m_seq, seq);
+  }
+  return blkaddr;
+}
+
+/* Acquires a block buffer for file identified by `ino` i-node and block index
+ * `idx`. When `ino` is zero the buffer refers to filesystem metadata (i.e.
+ * superblock, block group descriptors, block & i-node bitmap, etc.) and `off`
+ * offset is given from the start of block device. */
+static blk_t *blk_get(uint32_t ino, uint32_t idx) {
+  /* No translation for filesystem metadata blocks. */
+  if (ino == 0)
+    return blk_read(idx);
+
+  long blkaddr = blk_bmap(ino, idx);
+  if (blkaddr == -1)
+    return NULL;
+  if (blkaddr == 0)
+    return BLK_ZERO;
+  return blk_read(blkaddr);
+}
+
 /* Releases a block buffer. If reference counter hits 0 the buffer can be
- * reused to cache another block. The buffer is put at the beginning of LRU list
- * of unused blocks. */
+ * reused to cache another block. The buffer stays on its replacement queue. */
 static void blk_put(blk_t *blk) {
-  if (--blk->b_refcnt > 0)
+  blkshard_t *bs = blk_shard(blk->b_blkaddr);
+
+  pthread_mutex_lock(&bs->bs_lock);
+  assert(blk->b_refcnt > 0);
+  if (--blk->b_refcnt == 0 && bs->bs_waiting > 0)
+    pthread_cond_broadcast(&bs->bs_cv);
+  pthread_mutex_unlock(&bs->bs_lock);
+}
+
+/* Reads blocks of `n` addresses from `addrs` into the buffer cache with as few
+ * round trips to the device as possible. Blocks that are cached already, zero
+ * addresses and ones past the end of filesystem are skipped. This is only a
+ * hint: no buffer is held afterwards and no waiting is done for free ones. */
+static void blk_fetch(const uint32_t *addrs, size_t n) {
+  if (img_map != NULL || aio_sync)
     return;
 
-  TAILQ_INSERT_HEAD(&lrulst, blk, b_link);
+  while (n > 0) {
+    aioreq_t reqs[FETCH_MAX];
+    blk_t *blks[FETCH_MAX];
+    size_t cnt = min(n, fetch_max), nreqs = 0;
+
+    for (size_t i = 0; i < cnt; i++) {
+      bool fill;
+      blk_t *blk;
+      if (addrs[i] == 0 || addrs[i] >= block_count ||
+          !(blk = blk_lookup(addrs[i], true, &fill)))
+        continue;
+      blks[nreqs] = blk;
+      reqs[nreqs++] = (aioreq_t){.ar_buf = blk->b_data,
+                                 .ar_len = blksize,
+                                 .ar_off = (off_t)addrs[i] << blkshift};
+    }
+
+    if (aio_read(reqs, nreqs))
+      panic("Attempt to read past the end of filesystem!");
+
+    for (size_t i = 0; i < nreqs; i++) {
+      blk_ready(blks[i]);
+      blk_put(blks[i]);
+    }
+
+    addrs += cnt;
+    n -= cnt;
+  }
 }
 
 /*
  * Ext2 filesystem routines.
  */
 
-/* Reads block bitmap entry for `blkaddr`. Returns 0 if the block is free,
- * 1 if it's in use, and EINVAL if `blkaddr` is out of range. */
-int ext2_block_used(uint32_t blkaddr) {
-  if (blkaddr >= block_count)
-    return EINVAL;
-  int used = 0;
-#ifdef STUDENT
-  /* TODO */
-  size_t group_number = (blkaddr - 1) / blocks_per_group;
-  // info https://www.nongnu.org/ext2-doc/ext2.html#bg-block-bitmap
-  size_t bitmap_block = group_desc[group_number].gd_b_bitmap;
-  blk_t *blk = blk_get(0, bitmap_block);
-  uint8_t light_bit = 1 << (((blkaddr - 1) % blocks_per_group) % 8);
-  if ((light_bit &
-       *((uint8_t *)(blk->b_data + ((blkaddr - 1) % blocks_per_group) / 8))) >
-      0) {
-    used = 1;
-  }
-  blk_put(blk);
-#endif /* !STUDENT */
-  return used;
+/* Copies cache statistics gathered since the filesystem was mounted. */
+void ext2_stats(ext2_stats_t *st) {
+  *st = stats;
 }
 
-/* Reads i-node bitmap entry for `ino`. Returns 0 if the i-node is free,
- * 1 if it's in use, and EINVAL if `ino` value is out of range. */
-int ext2_inode_used(uint32_t ino) {
-  if (!ino || ino >= inode_count)
-    return EINVAL;
-  int used = 0;
-#ifdef STUDENT
-  /* TODO */
-  size_t block_group = (ino - 1) / inodes_per_group;
+/*
+ * Bitmap routines. Bitmaps are scanned a 64-bit word at a time. Bitmap blocks
+ * are at least 1KiB long and aligned, so whole words can always be read.
+ */
 
-  size_t local_inode_index = (ino - 1) % inodes_per_group;
+static inline bool bit_isset(const uint8_t *bitmap, size_t i) {
+  return bitmap[i / 8] & (1 << (i % 8));
+}
 
-  uint32_t bitmap_block = group_desc[block_group].gd_i_bitmap;
-  blk_t *blk = blk_get(0, bitmap_block);
-  uint8_t light_bit = 1 << (local_inode_index % 8);
+/* Returns `i`-th word of `bitmap`. Bit `n` of bitmap becomes bit `n % 64`
+ * of the word. */
+static inline uint64_t bitmap_word(const uint8_t *bitmap, size_t i) {
+  return le64toh(((const uint64_t *)bitmap)[i]);
+}
 
-  if ((light_bit & *((uint8_t *)(blk->b_data + local_inode_index / 8))) > 0) {
-    used = 1;
-  }
-  blk_put(blk);
-#endif /* !STUDENT */
-  return used;
+/* Returns mask that selects bits of `i`-th word within [start, nbits). */
+static inline uint64_t bitmap_mask(size_t i, size_t start, size_t nbits) {
+  uint64_t mask = ~0ULL;
+  if (i == start / 64)
+    mask &= ~0ULL << (start % 64);
+  if ((i + 1) * 64 > nbits)
+    mask &= ~0ULL >> (64 - nbits % 64);
+  return mask;
 }
 
-/* Reads i-node identified by number `ino`.
- * Returns 0 on success. If i-node is not allocated returns ENOENT. */
-static int ext2_inode_read(off_t ino, ext2_inode_t *inode) {
-#ifdef STUDENT
-  /* TODO */
-  if (ext2_inode_used(ino) != 1) {
-    return ENONET;
-  }
-  size_t block_group = (ino - 1) / inodes_per_group;
-  size_t local_inode_index = (ino - 1) % inodes_per_group;
-  uint32_t arr = group_desc[block_group].gd_i_tables;
-  size_t offset = local_inode_index * sizeof(ext2_inode_t);
-  ext2_read(0, inode, offset + BLKSIZE * arr, sizeof(ext2_inode_t));
-#endif /* !STUDENT */
-  return 0;
+/* Counts bits that are set among first `nbits` bits of `bitmap`. */
+static size_t bitmap_count(const uint8_t *bitmap, size_t nbits) {
+  size_t count = 0;
+  for (size_t i = 0; i < howmany(nbits, 64); i++)
+    count += __builtin_popcountll(bitmap_word(bitmap, i) &
+                                  bitmap_mask(i, 0, nbits));
+  return count;
 }
 
-/* Returns block pointer `blkidx` from block of `blkaddr` address. */
-static uint32_t ext2_blkptr_read(uint32_t blkaddr, uint32_t blkidx) {
-#ifdef STUDENT
-  /* TODO */
-  blk_t *blk = blk_get(0, blkaddr);
-  uint32_t block_ptr = ((uint32_t *)blk->b_data)[blkidx];
-  blk_put(blk);
-  return block_ptr;
-#endif /* !STUDENT */
-  return 0;
+/* Finds first bit at or after `start` that is set (if `set` is true) or
+ * clear among first `nbits` bits of `bitmap`. Returns `nbits` if none. */
+static size_t bitmap_find(const uint8_t *bitmap, size_t start, size_t nbits,
+                          bool set) {
+  for (size_t i = start / 64; i < howmany(nbits, 64); i++) {
+    uint64_t w = bitmap_word(bitmap, i);
+    if (!set)
+      w = ~w;
+    w &= bitmap_mask(i, start, nbits);
+    if (w)
+      return i * 64 + __builtin_ctzll(w);
+  }
+  return nbits;
 }
 
-/* Translates i-node number `ino` and block index `idx` to block address.
- * Returns -1 on failure, otherwise block address. */
-long ext2_blkaddr_read(uint32_t ino, uint32_t blkidx) {
-  /* No translation for filesystem metadata blocks. */
-  if (ino == 0)
-    return blkidx;
+/*
+ * Block group routines.
+ */
+
+static void fastdiv_init(fastdiv_t *fd, uint32_t divisor) {
+  fd->fd_divisor = divisor;
+  fd->fd_shift = __builtin_ctz(divisor);
+  fd->fd_magic = (divisor & (divisor - 1)) ? UINT64_MAX / divisor + 1 : 0;
+}
+
+static inline uint32_t fastdiv(const fastdiv_t *fd, uint32_t n) {
+  if (fd->fd_magic == 0)
+    return n >> fd->fd_shift;
+#ifdef __SIZEOF_INT128__
+  return ((unsigned __int128)fd->fd_magic * n) >> 64;
+#else
+  return n / fd->fd_divisor;
+#endif
+}
+
+static inline uint32_t fastmod(const fastdiv_t *fd, uint32_t n) {
+  if (fd->fd_magic == 0)
+    return n & (fd->fd_divisor - 1);
+#ifdef __SIZEOF_INT128__
+  return ((unsigned __int128)(fd->fd_magic * n) * fd->fd_divisor) >> 64;
+#else
+  return n % fd->fd_divisor;
+#endif
+}
+
+/* Builds block group summary from group descriptors. */
+static int group_init(void) {
+  fastdiv_init(&bpg_div, blocks_per_group);
+  fastdiv_init(&ipg_div, inodes_per_group);
+
+  if (!(groups = calloc(group_desc_count, sizeof(group_t))))
+    return ENOMEM;
+
+  for (size_t i = 0; i < group_desc_count; i++) {
+    ext2_groupdesc_t *gd = &group_desc[i];
+    group_t *g = &groups[i];
+    size_t grpblocks = block_count - first_data_block - i * blocks_per_group;
+
+    g->g_blocks = (grpmap_t){.gm_bitmap = gd->gd_b_bitmap,
+                             .gm_nbits = min(grpblocks, blocks_per_group),
+                             .gm_used = GRPMAP_UNKNOWN};
+    g->g_inodes = (grpmap_t){.gm_bitmap = gd->gd_i_bitmap,
+                             .gm_nbits = inodes_per_group,
+                             .gm_used = GRPMAP_UNKNOWN};
+    g->g_i_tables = gd->gd_i_tables;
+    g->g_nbfree = gd->gd_nbfree;
+    g->g_nifree = gd->gd_nifree;
+  }
+
+  free(group_desc);
+  group_desc = NULL;
+  return 0;
+}
+
+/* Returns number of bits set in group bitmap described by `gm`, and stores
+ * position of the first one in `firstp`. Many threads may compute the same
+ * values concurrently, which is harmless. */
+static uint32_t grpmap_used(grpmap_t *gm, uint32_t *firstp) {
+  uint32_t used = __atomic_load_n(&gm->gm_used, __ATOMIC_ACQUIRE);
+
+  if (used == GRPMAP_UNKNOWN) {
+    blk_t *blk = blk_read(gm->gm_bitmap);
+    uint32_t first = bitmap_find(blk->b_data, 0, gm->gm_nbits, true);
+    used = bitmap_count(blk->b_data, gm->gm_nbits);
+    blk_put(blk);
+    __atomic_store_n(&gm->gm_first, first, __ATOMIC_RELAXED);
+    __atomic_store_n(&gm->gm_used, used, __ATOMIC_RELEASE);
+  }
+
+  *firstp = __atomic_load_n(&gm->gm_first, __ATOMIC_RELAXED);
+  return used;
+}
+
+/* Finds first bit at or after `start` in group bitmap described by `gm` that
+ * is set (if `set` is true) or clear. Groups that have all bits set or clear
+ * are answered without reading the bitmap. Returns `gm_nbits` if none. */
+static uint32_t grpmap_find(grpmap_t *gm, uint32_t start, bool set) {
+  uint32_t first, used = grpmap_used(gm, &first);
+
+  if (set) {
+    if (used == 0)
+      return gm->gm_nbits;
+    if (start <= first)
+      return first;
+  } else {
+    if (used == gm->gm_nbits)
+      return gm->gm_nbits;
+    if (used == 0)
+      return start;
+  }
+
+  blk_t *blk = blk_read(gm->gm_bitmap);
+  uint32_t i = bitmap_find(blk->b_data, start, gm->gm_nbits, set);
+  blk_put(blk);
+  return i;
+}
+
+/* Counts blocks and i-nodes in use in block group `group`. Any of `blocks_p`
+ * and `inodes_p` can be NULL. Returns 0 on success or EINVAL if `group` is
+ * out of range. */
+int ext2_group_used(uint32_t group, uint32_t *blocks_p, uint32_t *inodes_p) {
+  if (group >= group_desc_count)
+    return EINVAL;
+
+  uint32_t first;
+  if (blocks_p)
+    *blocks_p = grpmap_used(&groups[group].g_blocks, &first);
+  if (inodes_p)
+    *inodes_p = grpmap_used(&groups[group].g_inodes, &first);
+  return 0;
+}
+
+/* Finds first block at or after `blkaddr` that is in use if `used` is
+ * non-zero, or free otherwise. Returns block address or -1 if not found. */
+long ext2_block_find(uint32_t blkaddr, int used) {
+  if (blkaddr >= block_count)
+    return -1;
+
+  /* Blocks before the first data block are not managed by block bitmap. */
+  if (blkaddr < first_data_block) {
+    if (!used)
+      return blkaddr;
+    blkaddr = first_data_block;
+  }
+
+  uint32_t group = fastdiv(&bpg_div, blkaddr - first_data_block);
+  uint32_t start = fastmod(&bpg_div, blkaddr - first_data_block);
+
+  for (; group < group_desc_count; group++, start = 0) {
+    grpmap_t *gm = &groups[group].g_blocks;
+    uint32_t i = grpmap_find(gm, start, used);
+    if (i < gm->gm_nbits)
+      return first_data_block + group * blocks_per_group + i;
+  }
+
+  return -1;
+}
 
-  ext2_inode_t inode;
-  if (ext2_inode_read(ino, &inode))
+/* Finds first i-node with number not less than `ino` that is in use if `used`
+ * is non-zero, or free otherwise. Returns i-node number or -1 if not found. */
+long ext2_inode_find(uint32_t ino, int used) {
+  if (!ino || ino > inode_count)
     return -1;
 
-    /* Read direct pointers or pointers from indirect blocks. */
+  uint32_t group = fastdiv(&ipg_div, ino - 1);
+  uint32_t start = fastmod(&ipg_div, ino - 1);
+
+  for (; group < group_desc_count; group++, start = 0) {
+    grpmap_t *gm = &groups[group].g_inodes;
+    uint32_t i = grpmap_find(gm, start, used);
+    if (i < gm->gm_nbits)
+      return group * inodes_per_group + i + 1;
+  }
+
+  return -1;
+}
+
+/* Reads block bitmap entry for `blkaddr`. Returns 0 if the block is free,
+ * 1 if it's in use, and EINVAL if `blkaddr` is out of range. */
+int ext2_block_used(uint32_t blkaddr) {
+  if (blkaddr >= block_count)
+    return EINVAL;
+  int used = 0;
 #ifdef STUDENT
-  /*
-     W https://www.nongnu.org/ext2-doc/ext2.html czytamy
-     There are pointers to the first 12 blocks which contain the file's data
-     in the inode.
-     There is a pointer to an indirect block
-     (which contains pointers to the next set of blocks),
-     a pointer to a doubly-indirect block
-     (which contains pointers to indirect blocks) and a pointer to a
-     trebly-indirect block (which contains pointers to doubly-indirect blocks).
-     Robiliśmy dokładnie takie zadanie na tablicy*/
-  // int num_direct_block = 12;
-  size_t available_blocks = EXT2_NDADDR;
-  if (blkidx < available_blocks) {
-    return inode.i_blocks[blkidx];
-  }
-  // 1 level
-  blkidx = blkidx - 12;
-  available_blocks = BLK_POINTERS;
-  if (blkidx < available_blocks) {
-    return ext2_blkptr_read(inode.i_blocks[12], blkidx);
-  }
-  blkidx = blkidx - available_blocks;
-  // 2 level
-  available_blocks = BLK_POINTERS * BLK_POINTERS;
-  if (blkidx < available_blocks) {
-    uint32_t first_table = blkidx / BLK_POINTERS;
-    uint32_t addres = ext2_blkptr_read(inode.i_blocks[13], first_table);
-
-    return ext2_blkptr_read(addres, blkidx % BLK_POINTERS);
-  }
-  blkidx = blkidx - available_blocks;
-  // 3 level
-  available_blocks = BLK_POINTERS * BLK_POINTERS * BLK_POINTERS;
-  if (blkidx < available_blocks) {
-   
-    uint32_t first_table = blkidx / (BLK_POINTERS * BLK_POINTERS);
-    uint32_t addres = ext2_blkptr_read(inode.i_blocks[14], first_table);
-   
-    uint32_t second_table = ext2_blkptr_read(addres, blkidx / BLK_POINTERS);
- 
-    return ext2_blkptr_read(second_table, blkidx % BLK_POINTERS);
+  /* TODO */
+  /* Blocks before the first data block are not managed by block bitmap. */
+  if (blkaddr < first_data_block)
+    return 0;
+  size_t group_number = fastdiv(&bpg_div, blkaddr - first_data_block);
+  // info https://www.nongnu.org/ext2-doc/ext2.html#bg-block-bitmap
+  size_t bitmap_block = groups[group_number].g_blocks.gm_bitmap;
+  size_t local_block_index = fastmod(&bpg_div, blkaddr - first_data_block);
+  blk_t *blk = blk_get(0, bitmap_block);
+  uint8_t light_bit = 1 << (local_block_index % 8);
+  if ((light_bit & *((uint8_t *)(blk->b_data + local_block_index / 8))) > 0) {
+    used = 1;
   }
+  blk_put(blk);
 #endif /* !STUDENT */
-  return -1;
+  return used;
+}
+
+/* Reads i-node bitmap entry for `ino`. Returns 0 if the i-node is free,
+ * 1 if it's in use, and EINVAL if `ino` value is out of range. */
+int ext2_inode_used(uint32_t ino) {
+  if (!ino || ino > inode_count)
+    return EINVAL;
+  int used = 0;
+#ifdef STUDENT
+  /* TODO */
+  size_t block_group = fastdiv(&ipg_div, ino - 1);
+
+  size_t local_inode_index = fastmod(&ipg_div, ino - 1);
+
+  uint32_t bitmap_block = groups[block_group].g_inodes.gm_bitmap;
+  blk_t *blk = blk_get(0, bitmap_block);
+  uint8_t light_bit = 1 << (local_inode_index % 8);
+
+  if ((light_bit & *((uint8_t *)(blk->b_data + local_inode_index / 8))) > 0) {
+    used = 1;
+  }
+  blk_put(blk);
+#endif /* !STUDENT */
+  return used;
+}
+
+/*
+ * I-node cache routines.
+ */
+
+/* Initializes i-node cache with `n` entries. */
+static int inode_init(size_t n) {
+  ninodes = n ? n : NINODES;
+  ibuckets_mask = roundup_pow2(ninodes) - 1;
+
+  icache = calloc(ninodes, sizeof(icache_t));
+  ibuckets = calloc(ibuckets_mask + 1, sizeof(icache_list_t));
+  if (icache == NULL || ibuckets == NULL)
+    return ENOMEM;
+
+  pthread_mutex_init(&ilock, NULL);
+  pthread_cond_init(&icv, NULL);
+
+  TAILQ_INIT(&ilrulst);
+  TAILQ_INIT(&ifreelst);
+  for (size_t i = 0; i <= ibuckets_mask; i++)
+    TAILQ_INIT(&ibuckets[i]);
+
+  for (size_t i = 0; i < ninodes; i++) {
+    pthread_mutex_init(&icache[i].ic_ralock, NULL);
+    TAILQ_INSERT_TAIL(&ifreelst, &icache[i], ic_link);
+  }
+
+  return 0;
+}
+
+/* Drops a reference to i-node cache entry. Must be called with `ilock`. */
+static void inode_release(icache_t *ic) {
+  assert(ic->ic_refcnt > 0);
+  if (--ic->ic_refcnt > 0)
+    return;
+  /* Someone may be waiting for an entry to become reusable. */
+  if (TAILQ_EMPTY(&ilrulst))
+    pthread_cond_broadcast(&icv);
+  TAILQ_INSERT_HEAD(&ilrulst, ic, ic_link);
+}
+
+/* Finds i-node `ino` on hash chain `bucket`. Must be called with `ilock`. */
+static icache_t *inode_find(icache_list_t *bucket, uint32_t ino) {
+  icache_t *ic;
+  TAILQ_FOREACH (ic, bucket, ic_hash) {
+    if (ic->ic_ino == ino)
+      return ic;
+  }
+  return NULL;
+}
+
+/* Takes an empty entry or reclaims least recently used entry that nobody
+ * refers to. Returns NULL if all entries are in use. Must be called with
+ * `ilock`. */
+static icache_t *inode_reclaim(void) {
+  icache_t *ic;
+
+  if ((ic = TAILQ_FIRST(&ifreelst))) {
+    TAILQ_REMOVE(&ifreelst, ic, ic_link);
+  } else if ((ic = TAILQ_LAST(&ilrulst, icache_list))) {
+    TAILQ_REMOVE(&ilrulst, ic, ic_link);
+    TAILQ_REMOVE(&ibuckets[hash2(ic->ic_ino, 0) & ibuckets_mask], ic, ic_hash);
+  } else {
+    return NULL;
+  }
+
+  free(ic->ic_extents);
+  ic->ic_extents = NULL;
+  ic->ic_nextents = 0;
+  memset(ic->ic_ra, 0, sizeof(ic->ic_ra));
+  return ic;
+}
+
+/* Returns index entry of `ino` i-node or NULL if it's not allocated. Must be
+ * called only if the index is loaded. */
+static const ixinode_t *index_inode(uint32_t ino) {
+  uint32_t lo = 0, hi = ixkey.ih_ninodes;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (ix_inodes[mid].ii_ino < ino)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < ixkey.ih_ninodes && ix_inodes[lo].ii_ino == ino)
+    return &ix_inodes[lo];
+  return NULL;
+}
+
+/* Reads i-node held by `ic` from i-node table together with its bit from
+ * i-node bitmap, or takes it from the metadata index if one is loaded.
+ * I-nodes that follow it in the same i-node table block are decoded in the
+ * same pass and put into the cache, since they're likely to be needed soon,
+ * e.g. when a directory is listed. Must be called without
+ * `ilock`, and `ic` must be referenced and marked as being loaded. */
+static void inode_load(icache_t *ic) {
+  if (ix_map != NULL) {
+    const ixinode_t *ii = index_inode(ic->ic_ino);
+    STAT_INC(ix_hits);
+    ic->ic_used = ii != NULL;
+    if (ic->ic_used)
+      ic->ic_inode = ii->ii_inode;
+    return;
+  }
+
+  uint32_t group = fastdiv(&ipg_div, ic->ic_ino - 1);
+  size_t index = fastmod(&ipg_div, ic->ic_ino - 1);
+  size_t last = min(index - index % BLK_INODES + BLK_INODES, inodes_per_group);
+  group_t *g = &groups[group];
+
+  blk_t *bitmap = blk_read(g->g_inodes.gm_bitmap);
+  blk_t *table = blk_read(g->g_i_tables + lblkno(index * inode_size));
+  const uint8_t *bits = bitmap->b_data;
+
+#define INODE_AT(i) ((ext2_inode_t *)(table->b_data + blkoff((i)*inode_size)))
+
+  ic->ic_used = bit_isset(bits, index);
+  if (ic->ic_used)
+    ic->ic_inode = *INODE_AT(index);
+
+  pthread_mutex_lock(&ilock);
+  for (size_t i = index + 1; i < last; i++) {
+    uint32_t ino = group * inodes_per_group + i + 1;
+    if (ino > inode_count)
+      break;
+    if (!bit_isset(bits, i))
+      continue;
+
+    icache_list_t *bucket = &ibuckets[hash2(ino, 0) & ibuckets_mask];
+    if (inode_find(bucket, ino))
+      continue;
+
+    icache_t *nic = inode_reclaim();
+    if (nic == NULL)
+      break;
+
+    nic->ic_ino = ino;
+    nic->ic_refcnt = 0;
+    nic->ic_loading = false;
+    nic->ic_used = true;
+    nic->ic_inode = *INODE_AT(i);
+    TAILQ_INSERT_HEAD(bucket, nic, ic_hash);
+    TAILQ_INSERT_HEAD(&ilrulst, nic, ic_link);
+  }
+  pthread_mutex_unlock(&ilock);
+
+#undef INODE_AT
+
+  blk_put(table);
+  blk_put(bitmap);
+}
+
+/* Acquires in-memory copy of i-node identified by number `ino`. Returns 0 on
+ * success, EINVAL if `ino` is out of range and ENOENT if the i-node is not
+ * allocated. Negative answers are cached as well. */
+static int inode_get(uint32_t ino, icache_t **icp) {
+  icache_list_t *bucket = &ibuckets[hash2(ino, 0) & ibuckets_mask];
+  icache_t *ic;
+
+  if (!ino || ino > inode_count)
+    return EINVAL;
+
+  pthread_mutex_lock(&ilock);
+
+  for (;;) {
+    if ((ic = inode_find(bucket, ino))) {
+      STAT_INC(ic_hits);
+      if (ic->ic_refcnt++ == 0)
+        TAILQ_REMOVE(&ilrulst, ic, ic_link);
+      /* Another thread is reading the i-node in, wait for it. */
+      while (ic->ic_loading)
+        pthread_cond_wait(&icv, &ilock);
+      break;
+    }
+
+    /* All entries are in use, wait for someone to release one. */
+    if (!(ic = inode_reclaim())) {
+      pthread_cond_wait(&icv, &ilock);
+      continue;
+    }
+
+    STAT_INC(ic_misses);
+
+    ic->ic_ino = ino;
+    ic->ic_refcnt = 1;
+    ic->ic_loading = true;
+    TAILQ_INSERT_HEAD(bucket, ic, ic_hash);
+
+    /* Do not hold the lock while reading bitmap and i-node table. */
+    pthread_mutex_unlock(&ilock);
+    inode_load(ic);
+    pthread_mutex_lock(&ilock);
+
+    ic->ic_loading = false;
+    pthread_cond_broadcast(&icv);
+    break;
+  }
+
+  if (!ic->ic_used) {
+    inode_release(ic);
+    pthread_mutex_unlock(&ilock);
+    return ENOENT;
+  }
+
+  pthread_mutex_unlock(&ilock);
+  *icp = ic;
+  return 0;
+}
+
+/* Releases in-memory i-node. If reference counter hits 0 the entry is put at
+ * the beginning of LRU list of unused entries. */
+static void inode_put(icache_t *ic) {
+  pthread_mutex_lock(&ilock);
+  inode_release(ic);
+  pthread_mutex_unlock(&ilock);
+}
+
+/*
+ * Block map routines.
+ */
+
+/* State of block map decoder. */
+typedef struct bmap {
+  extent_t *bm_extents; /* runs decoded so far */
+  uint32_t bm_count;    /* number of entries in `bm_extents` */
+  uint32_t bm_size;     /* capacity of `bm_extents` */
+  uint32_t bm_index;    /* index of next block to be decoded */
+  uint32_t bm_nblks;    /* number of blocks in the file */
+  uint32_t *bm_ptrs;    /* copies of indirect blocks, one for each level */
+} bmap_t;
+
+/* Appends `count` blocks starting at `blkaddr` to the block map. Extends last
+ * run if the blocks are adjacent to it on the block device. */
+static int bmap_append(bmap_t *bm, uint32_t blkaddr, uint32_t count) {
+  count = min(count, bm->bm_nblks - bm->bm_index);
+
+  if (bm->bm_count > 0) {
+    extent_t *last = &bm->bm_extents[bm->bm_count - 1];
+    if (blkaddr == 0 ? last->e_blkaddr == 0
+                     : last->e_blkaddr && last->e_blkaddr + last->e_count ==
+                                            blkaddr) {
+      last->e_count += count;
+      bm->bm_index += count;
+      return 0;
+    }
+  }
+
+  if (bm->bm_count == bm->bm_size) {
+    uint32_t size = bm->bm_size ? bm->bm_size * 2 : 4;
+    extent_t *extents = realloc(bm->bm_extents, size * sizeof(extent_t));
+    if (extents == NULL)
+      return ENOMEM;
+    bm->bm_extents = extents;
+    bm->bm_size = size;
+  }
+
+  bm->bm_extents[bm->bm_count++] =
+    (extent_t){.e_index = bm->bm_index, .e_blkaddr = blkaddr, .e_count = count};
+  bm->bm_index += count;
+  return 0;
+}
+
+/* Decodes block pointer `blkaddr` that is `level` steps away from data blocks,
+ * i.e. 0 for a data block, 1 for an indirect block and so on. Zero pointer
+ * describes a hole as large as the whole subtree. */
+static int bmap_walk(bmap_t *bm, uint32_t blkaddr, int level) {
+  uint32_t span = 1;
+  for (int i = 0; i < level; i++)
+    span *= BLK_POINTERS;
+
+  if (bm->bm_index >= bm->bm_nblks)
+    return 0;
+  if (blkaddr >= block_count)
+    return EINVAL;
+  if (level == 0 || blkaddr == 0)
+    return bmap_append(bm, blkaddr, span);
+
+  /* Do not hold the buffer while descending, as there may be many threads
+   * doing the same thing and few buffers. Blocks can be large, so copies
+   * are kept on the heap rather than the stack. */
+  uint32_t *blkptrs = bm->bm_ptrs + (level - 1) * BLK_POINTERS;
+  blk_t *blk = blk_read(blkaddr);
+  memcpy(blkptrs, blk->b_data, blksize);
+  blk_put(blk);
+
+  /* Children that are indirect blocks too are read in all at once. */
+  if (level >= 2) {
+    uint32_t child = span / BLK_POINTERS;
+    blk_fetch(blkptrs, min(BLK_POINTERS,
+                           howmany(bm->bm_nblks - bm->bm_index, child)));
+  }
+
+  int error = 0;
+  for (size_t i = 0; i < BLK_POINTERS && !error; i++)
+    error = bmap_walk(bm, blkptrs[i], level - 1);
+  return error;
+}
+
+/* Decodes direct and indirect block pointers of `inode` into list of runs.
+ * Returns 0 on success, or EINVAL if the block map is corrupted. */
+static int bmap_decode(ext2_inode_t *inode, extent_t **extp, uint32_t *np) {
+  bmap_t bm = {.bm_nblks = howmany(inode->i_size, blksize)};
+  int error = 0;
+
+  /* Fast symlinks keep their contents where block pointers would be. */
+  if ((inode->i_mode & EXT2_IFMT) == EXT2_IFLNK &&
+      inode->i_size < EXT2_MAXSYMLINKLEN)
+    bm.bm_nblks = 0;
+
+  /* Read in the roots of indirect block trees that will be descended. */
+  uint32_t left = bm.bm_nblks > EXT2_NDADDR ? bm.bm_nblks - EXT2_NDADDR : 0;
+  uint32_t nroots = 0;
+  for (uint32_t span = 1; left > 0 && nroots < EXT2_NIADDR; nroots++) {
+    span *= BLK_POINTERS;
+    left -= min(left, span);
+  }
+  blk_fetch(&inode->i_blocks[EXT2_NDADDR], nroots);
+
+  /* Deepest tree that will be descended has `nroots` levels. */
+  if (nroots > 0 && !(bm.bm_ptrs = malloc(nroots * blksize)))
+    return ENOMEM;
+
+  for (int i = 0; i < EXT2_NDADDR && !error; i++)
+    error = bmap_walk(&bm, inode->i_blocks[i], 0);
+  for (int i = 0; i < EXT2_NIADDR && !error; i++)
+    error = bmap_walk(&bm, inode->i_blocks[EXT2_NDADDR + i], i + 1);
+
+  free(bm.bm_ptrs);
+
+  if (error) {
+    free(bm.bm_extents);
+    return error;
+  }
+
+  *extp = bm.bm_extents;
+  *np = bm.bm_count;
+  return 0;
+}
+
+/* Copies block map of `ino` i-node out of the metadata index. Returns ENOENT
+ * if the index is not loaded or it has no block map of the i-node. */
+static int index_bmap(uint32_t ino, extent_t **extp, uint32_t *np) {
+  const ixinode_t *ii;
+
+  if (ix_map == NULL || !(ii = index_inode(ino)) || (ii->ii_flags & IX_NOMAP))
+    return ENOENT;
+
+  *extp = NULL;
+  *np = ii->ii_nextents;
+  if (*np == 0)
+    return 0;
+
+  if (!(*extp = malloc(*np * sizeof(extent_t))))
+    return ENOMEM;
+  memcpy(*extp, &ix_extents[ii->ii_extent], *np * sizeof(extent_t));
+  return 0;
+}
+
+/* Returns block map of i-node held by `ic`. Block map is decoded only once,
+ * so subsequent calls are cheap. */
+static int inode_bmap(icache_t *ic, extent_t **extp, uint32_t *np) {
+  extent_t *extents = NULL;
+  uint32_t nextents = 0;
+  int error = 0;
+
+  pthread_mutex_lock(&ilock);
+
+  /* Another thread is decoding the block map, wait for it. */
+  while (ic->ic_mapping)
+    pthread_cond_wait(&icv, &ilock);
+
+  if (ic->ic_extents == NULL) {
+    ic->ic_mapping = true;
+    pthread_mutex_unlock(&ilock);
+    error = index_bmap(ic->ic_ino, &extents, &nextents);
+    if (error == ENOENT)
+      error = bmap_decode(&ic->ic_inode, &extents, &nextents);
+    pthread_mutex_lock(&ilock);
+    ic->ic_extents = extents;
+    ic->ic_nextents = nextents;
+    ic->ic_mapping = false;
+    pthread_cond_broadcast(&icv);
+  }
+
+  *extp = ic->ic_extents;
+  *np = ic->ic_nextents;
+  pthread_mutex_unlock(&ilock);
+  return error;
+}
+
+/* Returns index of the run from `extents` that contains block `blkidx`, or
+ * `n` if there's none. */
+static uint32_t bmap_find(extent_t *extents, uint32_t n, uint32_t blkidx) {
+  uint32_t lo = 0, hi = n;
+
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    extent_t *e = &extents[mid];
+    if (blkidx < e->e_index)
+      hi = mid;
+    else if (blkidx >= e->e_index + e->e_count)
+      lo = mid + 1;
+    else
+      return mid;
+  }
+
+  return n;
+}
+
+/* Translates i-node number `ino` and block index `idx` to block address.
+ * Returns -1 on failure, otherwise block address. */
+long ext2_blkaddr_read(uint32_t ino, uint32_t blkidx) {
+  /* No translation for filesystem metadata blocks. */
+  if (ino == 0)
+    return blkidx;
+
+  icache_t *ic;
+  if (inode_get(ino, &ic))
+    return -1;
+
+  long blkaddr = -1;
+  extent_t *extents;
+  uint32_t n;
+
+  if (!inode_bmap(ic, &extents, &n)) {
+    uint32_t i = bmap_find(extents, n, blkidx);
+    if (i < n && extents[i].e_blkaddr)
+      blkaddr = extents[i].e_blkaddr + (blkidx - extents[i].e_index);
+    else if (i < n)
+      blkaddr = 0;
+  }
+
+  inode_put(ic);
+  return blkaddr;
+}
+
+/* Reads of whole blocks that are collected by `blk_copy` to be submitted
+ * together. */
+typedef struct readbatch {
+  aioreq_t rb_reqs[AIO_DEPTH];
+  size_t rb_n;
+} readbatch_t;
+
+/* Submits all reads collected in `rb` and waits for them. */
+static int readbatch_flush(readbatch_t *rb) {
+  int error = aio_read(rb->rb_reqs, rb->rb_n);
+  rb->rb_n = 0;
+  return error;
+}
+
+/* Copies `len` bytes starting from `off` offset of filesystem image. Whole
+ * blocks are read with a single `pread`, partial ones go through the buffer
+ * cache. If the image is mapped into memory, data is copied straight away.
+ * If `rb` is given, whole blocks are only queued on it, and the data is there
+ * after `readbatch_flush`. */
+static int blk_copy(void *data, size_t off, size_t len, readbatch_t *rb) {
+  if (img_map != NULL) {
+    if (off + len > img_size)
+      return EINVAL;
+    memcpy(data, img_map + off, len);
+    return 0;
+  }
+
+  while (len > 0) {
+    size_t boff = blkoff(off);
+    size_t cnt;
+
+    if (boff == 0 && len >= blksize && rb != NULL) {
+      int error;
+      if (rb->rb_n == AIO_DEPTH && (error = readbatch_flush(rb)))
+        return error;
+      cnt = len - blkoff(len);
+      rb->rb_reqs[rb->rb_n++] =
+        (aioreq_t){.ar_buf = data, .ar_len = cnt, .ar_off = off};
+    } else if (boff == 0 && len >= blksize) {
+      cnt = len - blkoff(len);
+      ssize_t nread = pread(fd_ext2, data, cnt, off);
+      if (nread <= 0)
+        return EINVAL;
+      cnt = nread;
+    } else {
+      cnt = min(len, blksize - boff);
+      blk_t *blk = blk_read(lblkno(off));
+      memcpy(data, blk->b_data + boff, cnt);
+      blk_put(blk);
+    }
+
+    data += cnt;
+    off += cnt;
+    len -= cnt;
+  }
+
+  return 0;
+}
+
+/* Tells the kernel that `len` bytes starting from `off` offset of filesystem
+ * image will be needed soon, so it can start reading them in background. */
+static void blk_willneed(size_t off, size_t len) {
+  if (img_map != NULL) {
+    size_t pgmask = sysconf(_SC_PAGESIZE) - 1;
+    size_t start = off & ~pgmask;
+    if (off >= img_size)
+      return;
+    if (off + len > img_size)
+      len = img_size - off;
+    (void)madvise(img_map + start, off + len - start, MADV_WILLNEED);
+  } else {
+    (void)posix_fadvise(fd_ext2, off, len, POSIX_FADV_WILLNEED);
+  }
+}
+
+/* Picks the stream of `nra` streams from `ra` that a read from `pos` position
+ * continues. If there is none, then the least established stream is taken
+ * over, so sequential readers keep their windows despite random reads. */
+static rastate_t *readahead_stream(rastate_t *ra, size_t nra, size_t pos) {
+  rastate_t *victim = ra;
+  for (size_t i = 0; i < nra; i++) {
+    if (ra[i].ra_pos == pos)
+      return &ra[i];
+    if (ra[i].ra_window < victim->ra_window)
+      victim = &ra[i];
+  }
+  return victim;
+}
+
+/* Updates readahead state of `nra` streams from `ra`, protected by `lock`,
+ * after a read of `len` bytes from `pos` position of a file of `size` bytes.
+ * Stores the range of blocks that should be read ahead in `firstp` and
+ * `countp`. */
+static void readahead_update(rastate_t *ra, size_t nra, pthread_mutex_t *lock,
+                             size_t size, size_t pos, size_t len,
+                             uint32_t *firstp, uint32_t *countp) {
+  uint32_t next = howmany(pos + len, blksize);
+  uint32_t nblks = howmany(size, blksize);
+
+  *countp = 0;
+
+  pthread_mutex_lock(lock);
+
+  ra = readahead_stream(ra, nra, pos);
+
+  /* Random access stops readahead until the file is read sequentially. */
+  if (pos != ra->ra_pos) {
+    ra->ra_window = 0;
+    ra->ra_end = 0;
+  } else if (ra->ra_window == 0) {
+    ra->ra_window = min(RA_MIN, ra_max);
+  }
+  ra->ra_pos = pos + len;
+
+  /* Read next window when half of the previous one has been consumed. */
+  uint32_t window = ra->ra_window;
+  if (window > 0 && ra->ra_end < next + window / 2 && next < nblks) {
+    uint32_t first = max(ra->ra_end, next);
+    uint32_t end = min(next + window, nblks);
+    if (first < end) {
+      *firstp = first;
+      *countp = end - first;
+      ra->ra_end = end;
+    }
+    ra->ra_window = min(window * 2, ra_max);
+  }
+
+  pthread_mutex_unlock(lock);
+}
+
+/* Issues readahead of `count` blocks starting from `first` block of file
+ * described by `extents` block map. Holes are skipped. */
+static void bmap_readahead(extent_t *extents, uint32_t n, uint32_t first,
+                           uint32_t count) {
+  uint32_t end = first + count;
+
+  STAT_INC(ra_requests);
+  __atomic_fetch_add(&stats.ra_blocks, count, __ATOMIC_RELAXED);
+
+  for (uint32_t i = bmap_find(extents, n, first); i < n; i++) {
+    extent_t *e = &extents[i];
+    if (e->e_index >= end)
+      break;
+    if (e->e_blkaddr == 0)
+      continue;
+    uint32_t start = max(e->e_index, first);
+    uint32_t stop = min(e->e_index + e->e_count, end);
+    blk_willneed((size_t)(e->e_blkaddr + start - e->e_index) << blkshift,
+                 (size_t)(stop - start) << blkshift);
+  }
+}
+
+/* Sequential readers get blocks they'll ask for next read in background. */
+static void bmap_readahead_update(extent_t *extents, uint32_t n,
+                                  rastate_t *ra, size_t nra,
+                                  pthread_mutex_t *lock, size_t size,
+                                  size_t pos, size_t len) {
+  uint32_t ra_first, ra_count = 0;
+  if (ra_max > 0 && len > 0)
+    readahead_update(ra, nra, lock, size, pos, len, &ra_first, &ra_count);
+  if (ra_count > 0)
+    bmap_readahead(extents, n, ra_first, ra_count);
+}
+
+/* Prepares reading at most `len` bytes from `pos` position of `ic` file: the
+ * length is clipped to the end of file, readahead is issued and the block map
+ * is returned in `extentsp` and `np`. */
+static int inode_read_begin(icache_t *ic, size_t pos, size_t *lenp,
+                            extent_t **extentsp, uint32_t *np) {
+  size_t size = ic->ic_inode.i_size;
+  int error;
+
+  *lenp = pos < size ? min(*lenp, size - pos) : 0;
+  if (*lenp == 0)
+    return 0;
+
+  if ((error = inode_bmap(ic, extentsp, np)))
+    return error;
+
+  bmap_readahead_update(*extentsp, *np, ic->ic_ra, RA_STREAMS, &ic->ic_ralock,
+                        size, pos, *lenp);
+  return 0;
+}
+
+/* Returns extent of `extents` that holds byte at `pos` and the number of bytes
+ * from `pos` to the end of the extent in `cntp`, or NULL if block map is too
+ * short. `*ip` is a hint where to start looking and it's advanced. */
+static extent_t *bmap_next(extent_t *extents, uint32_t n, uint32_t *ip,
+                           size_t pos, size_t *cntp) {
+  if (*ip >= n || pos >= ((size_t)(extents[*ip].e_index +
+                                   extents[*ip].e_count) << blkshift))
+    *ip = bmap_find(extents, n, lblkno(pos));
+  if (*ip >= n)
+    return NULL;
+
+  extent_t *e = &extents[*ip];
+  size_t start = pos - ((size_t)e->e_index << blkshift);
+  *cntp = ((size_t)e->e_count << blkshift) - start;
+  return e;
+}
+
+/* Copies `len` bytes from `pos` position of file described by `extents`
+ * block map into `iov` buffers. Adds the number of bytes copied to `countp`. */
+static int bmap_readv(extent_t *extents, uint32_t n, const struct iovec *iov,
+                      size_t pos, size_t len, size_t *countp) {
+  readbatch_t rb = {.rb_n = 0};
+  size_t iovoff = 0;
+  uint32_t i = 0;
+  int error = 0;
+
+  /* Each piece of a run that fits into current buffer is copied at once. */
+  while (!error && len > 0) {
+    size_t cnt;
+    extent_t *e = bmap_next(extents, n, &i, pos, &cnt);
+    if (e == NULL)
+      return EINVAL;
+
+    while (iov->iov_len == iovoff)
+      iov++, iovoff = 0;
+
+    void *data = iov->iov_base + iovoff;
+    cnt = min(cnt, min(len, iov->iov_len - iovoff));
+
+    if (e->e_blkaddr == 0)
+      memset(data, 0, cnt);
+    else
+      error = blk_copy(data, ((size_t)e->e_blkaddr << blkshift) + pos -
+                               ((size_t)e->e_index << blkshift),
+                       cnt, &rb);
+
+    if (!error)
+      *countp += cnt;
+    iovoff += cnt;
+    pos += cnt;
+    len -= cnt;
+  }
+
+  /* Whole blocks of all runs are read in at once. */
+  int ferror = readbatch_flush(&rb);
+  return error ? error : ferror;
+}
+
+/* Returns total length of `iovcnt` buffers described by `iov`. */
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  for (int k = 0; k < iovcnt; k++)
+    len += iov[k].iov_len;
+  return len;
+}
+
+/* Reads data starting from `pos` position of any file (i.e. regular,
+ * directory, etc.) identified by `ino` i-node into `iovcnt` buffers described
+ * by `iov`, filling each before moving to the next one. Reading stops at the
+ * end of file, and the number of bytes read is stored in `countp`. Holes are
+ * filled with zeros. Returns 0 on success, EINVAL if block map is damaged or
+ * error if i-node could not be read. */
+int ext2_readv(uint32_t ino, const struct iovec *iov, int iovcnt, size_t pos,
+               size_t *countp) {
+  size_t len = iov_length(iov, iovcnt);
+
+  *countp = 0;
+
+  icache_t *ic;
+  int error;
+  if ((error = inode_get(ino, &ic)))
+    return error;
+
+  extent_t *extents = NULL;
+  uint32_t n = 0;
+  if (!(error = inode_read_begin(ic, pos, &len, &extents, &n)))
+    error = bmap_readv(extents, n, iov, pos, len, countp);
+
+  inode_put(ic);
+  return error;
+}
+
+/* Reads exactly `len` bytes starting from `pos` position from any file (i.e.
+ * regular, directory, etc.) identified by `ino` i-node. Returns 0 on success,
+ * EINVAL if `pos` and `len` would have pointed past the last block of file.
+ *
+ * WARNING: This function assumes that `ino` i-node pointer is valid! */
+int ext2_read(uint32_t ino, void *data, size_t pos, size_t len) {
+  /* Filesystem metadata is read directly from the image. */
+  if (ino == 0)
+    return blk_copy(data, pos, len, NULL);
+
+  struct iovec iov = {.iov_base = data, .iov_len = len};
+  size_t count;
+
+  if (ext2_readv(ino, &iov, 1, pos, &count) || count < len)
+    return EINVAL;
+  return 0;
+}
+
+/* Describes `len` bytes from `pos` position of file described by `extents`
+ * block map with at most `*nrunsp` runs (see `ext2_runs`). */
+static int bmap_runs(extent_t *extents, uint32_t n, size_t pos, size_t len,
+                     ext2_run_t *runs, int *nrunsp, size_t *countp) {
+  int maxruns = *nrunsp;
+  uint32_t i = 0;
+
+  *nrunsp = 0;
+
+  while (len > 0 && *nrunsp < maxruns) {
+    size_t cnt;
+    extent_t *e = bmap_next(extents, n, &i, pos, &cnt);
+    if (e == NULL)
+      return EINVAL;
+
+    cnt = min(cnt, len);
+
+    ext2_run_t *r = &runs[(*nrunsp)++];
+    r->r_len = cnt;
+    r->r_off = e->e_blkaddr ? (off_t)(((size_t)e->e_blkaddr << blkshift) +
+                                      pos - ((size_t)e->e_index << blkshift))
+                            : -1;
+    *countp += cnt;
+    pos += cnt;
+    len -= cnt;
+  }
+
+  return 0;
+}
+
+/* Describes up to `len` bytes starting from `pos` position of `ino` file as
+ * runs of bytes that are consecutive in the filesystem image, so the caller
+ * can transfer them by itself (e.g. splice them from `ext2_image_fd`). Holes
+ * are described by runs with `r_off` equal to -1. `*nrunsp` is the capacity
+ * of `runs` on entry and the number of runs used on return, and `countp` gets
+ * the number of bytes described, which is less than asked for at the end of
+ * file or if `runs` is too short. Returns 0 on success, EINVAL if block map is
+ * damaged or error if i-node could not be read. */
+int ext2_runs(uint32_t ino, size_t pos, size_t len, ext2_run_t *runs,
+              int *nrunsp, size_t *countp) {
+  *countp = 0;
+
+  icache_t *ic;
+  int error;
+  if ((error = inode_get(ino, &ic))) {
+    *nrunsp = 0;
+    return error;
+  }
+
+  extent_t *extents = NULL;
+  uint32_t n = 0;
+  if (!(error = inode_read_begin(ic, pos, &len, &extents, &n)))
+    error = bmap_runs(extents, n, pos, len, runs, nrunsp, countp);
+  else
+    *nrunsp = 0;
+
+  inode_put(ic);
+  return error;
+}
+
+/* Returns file descriptor of filesystem image that `ext2_runs` refers to. */
+int ext2_image_fd(void) {
+  return fd_ext2;
+}
+
+/* Finds the next data (`whence` is SEEK_DATA) or hole (SEEK_HOLE) position at
+ * or after `off` in a `size` bytes long file described by `extents` block map.
+ * Holes are found by the block map decoder, which skips zero pointers to
+ * indirect blocks without reading them, so this costs time proportional to
+ * the number of runs. There's an implicit hole at the end of file. */
+static int bmap_seek(extent_t *extents, uint32_t n, size_t size, off_t off,
+                     int whence, off_t *offp) {
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return EINVAL;
+  if (off < 0 || (size_t)off >= size)
+    return ENXIO;
+
+  bool data = whence == SEEK_DATA;
+  uint32_t i = bmap_find(extents, n, lblkno((size_t)off));
+
+  for (; i < n; i++) {
+    extent_t *e = &extents[i];
+    if ((e->e_blkaddr != 0) == data) {
+      *offp = max(off, (off_t)((size_t)e->e_index << blkshift));
+      if ((size_t)*offp >= size)
+        break;
+      return 0;
+    }
+  }
+
+  if (data)
+    return ENXIO;
+  *offp = size;
+  return 0;
+}
+
+/* Repositions `off` offset of `ino` file to the beginning of next data
+ * region or hole, as `lseek` does for SEEK_DATA and SEEK_HOLE `whence`, and
+ * stores the result in `offp`. A file can be copied without reading its holes
+ * by alternating the two. Returns 0 on success, ENXIO if there is no data
+ * past `off` or `off` is beyond the end of file, EINVAL if `whence` is not
+ * supported or error if i-node or its block map could not be read. */
+int ext2_seek(uint32_t ino, off_t off, int whence, off_t *offp) {
+  icache_t *ic;
+  int error;
+  if ((error = inode_get(ino, &ic)))
+    return error;
+
+  extent_t *extents;
+  uint32_t n;
+  if (!(error = inode_bmap(ic, &extents, &n)))
+    error = bmap_seek(extents, n, ic->ic_inode.i_size, off, whence, offp);
+
+  inode_put(ic);
+  return error;
+}
+
+/* Open file. It holds a private copy of the block map, so reads need not look
+ * up the i-node, and its own readahead state, so that a sequential reader is
+ * not disturbed by other readers of the same file. */
+struct ext2_file {
+  pthread_mutex_t f_lock; /* protects `f_ra` */
+  size_t f_size;          /* file size in bytes */
+  uint32_t f_nextents;    /* number of entries in `f_extents` */
+  extent_t *f_extents;    /* block map sorted by block index */
+  rastate_t f_ra;         /* readahead state */
+};
+
+/* Opens `ino` file for reading and stores the handle in `fp`. The i-node is
+ * not pinned in the i-node cache, so any number of files can be open. Returns
+ * 0 on success, ENOMEM if out of memory or error if i-node or its block map
+ * could not be read. */
+int ext2_open(uint32_t ino, ext2_file_t **fp) {
+  ext2_file_t *f;
+  int error;
+
+  if (!(f = calloc(1, sizeof(ext2_file_t))))
+    return ENOMEM;
+
+  icache_t *ic;
+  if ((error = inode_get(ino, &ic))) {
+    free(f);
+    return error;
+  }
+
+  extent_t *extents;
+  uint32_t n;
+  if (!(error = inode_bmap(ic, &extents, &n))) {
+    f->f_size = ic->ic_inode.i_size;
+    f->f_nextents = n;
+    if (n > 0) {
+      if ((f->f_extents = malloc(n * sizeof(extent_t))))
+        memcpy(f->f_extents, extents, n * sizeof(extent_t));
+      else
+        error = ENOMEM;
+    }
+  }
+
+  inode_put(ic);
+
+  if (error) {
+    free(f);
+    return error;
+  }
+
+  pthread_mutex_init(&f->f_lock, NULL);
+  *fp = f;
+  return 0;
+}
+
+/* Closes file opened with `ext2_open`. */
+void ext2_close(ext2_file_t *f) {
+  pthread_mutex_destroy(&f->f_lock);
+  free(f->f_extents);
+  free(f);
+}
+
+/* Clips `len` bytes long read from `pos` position to the end of `f` file and
+ * issues readahead on behalf of the file's reader. */
+static size_t file_read_begin(ext2_file_t *f, size_t pos, size_t len) {
+  len = pos < f->f_size ? min(len, f->f_size - pos) : 0;
+  bmap_readahead_update(f->f_extents, f->f_nextents, &f->f_ra, 1, &f->f_lock,
+                        f->f_size, pos, len);
+  return len;
+}
+
+/* Same as `ext2_readv`, but reads open file `f`. */
+int ext2_file_readv(ext2_file_t *f, const struct iovec *iov, int iovcnt,
+                    size_t pos, size_t *countp) {
+  size_t len = file_read_begin(f, pos, iov_length(iov, iovcnt));
+  *countp = 0;
+  return bmap_readv(f->f_extents, f->f_nextents, iov, pos, len, countp);
+}
+
+/* Same as `ext2_runs`, but describes data of open file `f`. */
+int ext2_file_runs(ext2_file_t *f, size_t pos, size_t len, ext2_run_t *runs,
+                   int *nrunsp, size_t *countp) {
+  len = file_read_begin(f, pos, len);
+  *countp = 0;
+  return bmap_runs(f->f_extents, f->f_nextents, pos, len, runs, nrunsp,
+                   countp);
+}
+
+/* Same as `ext2_seek`, but looks for data or holes of open file `f`. */
+int ext2_file_seek(ext2_file_t *f, off_t off, int whence, off_t *offp) {
+  return bmap_seek(f->f_extents, f->f_nextents, f->f_size, off, whence, offp);
+}
+
+/* Starts iteration over entries of `ino` directory at `off` offset, which is
+ * assumed to be 0 or taken from `dv_off` of a previously returned entry.
+ * Returns 0 on success, ENOTDIR if the file is not a directory, or error if
+ * i-node could not be read. */
+int ext2_dir_open(uint32_t ino, uint32_t off, ext2_dir_t *dir) {
+  int error;
+
+  icache_t *ic;
+  if ((error = inode_get(ino, &ic)))
+    return error;
+  uint16_t mode = ic->ic_inode.i_mode;
+  uint32_t size = ic->ic_inode.i_size;
+  inode_put(ic);
+
+  if ((mode & EXT2_IFMT) != EXT2_IFDIR)
+    return ENOTDIR;
+
+  dir->di_ino = ino;
+  dir->di_size = size;
+  dir->di_off = off;
+  dir->di_blkidx = 0;
+  dir->di_blk = NULL;
+  return 0;
 }
 
-/* Reads exactly `len` bytes starting from `pos` position from any file (i.e.
- * regular, directory, etc.) identified by `ino` i-node. Returns 0 on success,
- * EINVAL if `pos` and `len` would have pointed past the last block of file.
- *
- * WARNING: This function assumes that `ino` i-node pointer is valid! */
-int ext2_read(uint32_t ino, void *data, size_t pos, size_t len) {
-#ifdef STUDENT
-  /* TODO */
-  if (ino != 0) {
-    ext2_inode_t i;
-    ext2_inode_read(ino, &i);
-    if (i.i_size < pos + len) {
-      return EINVAL;
-    }
-  }
-  blk_t *blk;
-  uint32_t blk_num = pos / BLKSIZE;
-  uint32_t loaded = 0;
-  uint32_t available_to_load = BLKSIZE - (pos % BLKSIZE);
-  uint32_t offset = pos % BLKSIZE;
-  size_t read;
-
-  while (loaded < len) {
-    if (len > available_to_load) {
-      read = available_to_load;
-    } else {
-      read = len;
+/* Returns next used entry of directory in `dv`. Directory block that contains
+ * the entry is kept pinned, so the name is not copied and it's valid until
+ * next call to `ext2_dir_next` or `ext2_dir_close`. Returns 1 on success,
+ * 0 if there are no more entries to read. */
+int ext2_dir_next(ext2_dir_t *dir, ext2_dirview_t *dv) {
+  blk_t *blk = dir->di_blk;
+
+  while (dir->di_off < dir->di_size) {
+    uint32_t idx = lblkno(dir->di_off);
+    uint32_t off = blkoff(dir->di_off);
+
+    /* Move on to the block that contains next entry. */
+    if (blk == NULL || dir->di_blkidx != idx) {
+      if (blk != NULL)
+        blk_put(blk);
+      blk = blk_get(dir->di_ino, idx);
+      if (blk == NULL || blk == BLK_ZERO) {
+        /* Holes in directories are not expected, skip the block. */
+        blk = NULL;
+        dir->di_off = (idx + 1) << blkshift;
+        continue;
+      }
+      dir->di_blkidx = idx;
     }
-    blk = blk_get(ino, blk_num);
-    if (blk != BLK_ZERO) {
-      memcpy(data + loaded, blk->b_data + offset, read);
-      blk_put(blk);
-    } else {
-      loaded -= read;
+
+    /* Entries must not cross block boundary. Skip the rest of block if the
+     * entry seems to be corrupted. */
+    ext2_dirent_t *de = blk->b_data + off;
+    if (blksize - off < EXT2_DIRSIZE(0) || de->de_reclen < EXT2_DIRSIZE(0) ||
+        de->de_reclen > blksize - off ||
+        EXT2_DIRSIZE(de->de_namelen) > de->de_reclen) {
+      dir->di_off = (idx + 1) << blkshift;
+      continue;
     }
-    offset = 0;
-    loaded += read;
-    available_to_load = BLKSIZE;
-    blk_num++;
+
+    dir->di_off += de->de_reclen;
+
+    if (de->de_ino == 0)
+      continue;
+
+    dv->dv_ino = de->de_ino;
+    dv->dv_type = de->de_type;
+    dv->dv_namelen = de->de_namelen;
+    dv->dv_name = de->de_name;
+    dv->dv_off = dir->di_off;
+    dir->di_blk = blk;
+    return 1;
   }
+
+  if (blk != NULL)
+    blk_put(blk);
+  dir->di_blk = NULL;
   return 0;
-#endif /* !STUDENT */
-  return EINVAL;
+}
+
+/* Finishes iteration over directory entries and releases pinned block. */
+void ext2_dir_close(ext2_dir_t *dir) {
+  if (dir->di_blk != NULL)
+    blk_put(dir->di_blk);
+  dir->di_blk = NULL;
 }
 
 /* Reads a directory entry at position stored in `off_p` from `ino` i-node that
@@ -393,36 +2510,26 @@ int ext2_read(uint32_t ino, void *data, size_t pos, size_t len) {
  * `de->de_name` must be NUL-terminated. Assumes that entry offset is 0 or was
  * set by previous call to `ext2_readdir`. Returns 1 on success, 0 if there are
  * no more entries to read. */
-#define de_name_offset offsetof(ext2_dirent_t, de_name)
-
 int ext2_readdir(uint32_t ino, uint32_t *off_p, ext2_dirent_t *de) {
-#ifdef STUDENT
-  /* TODO */
-  ext2_inode_t inode;
-  ext2_inode_read(ino, &inode);
-  if (inode.i_size <= *off_p) {
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+
+  if (ext2_dir_open(ino, *off_p, &dir))
     return 0;
+
+  int found = ext2_dir_next(&dir, &dv);
+  if (found) {
+    de->de_ino = dv.dv_ino;
+    de->de_reclen = dv.dv_off - *off_p;
+    de->de_namelen = dv.dv_namelen;
+    de->de_type = dv.dv_type;
+    memcpy(de->de_name, dv.dv_name, dv.dv_namelen);
+    de->de_name[dv.dv_namelen] = '\0';
+    *off_p = dv.dv_off;
   }
-  ext2_read(ino, de, *off_p, de_name_offset);
-  ext2_read(ino, de->de_name, *off_p + de_name_offset, de->de_namelen);
-  de->de_name[de->de_namelen] = '\0';
-  *off_p += de->de_reclen;
-  if (de->de_ino > 0) {
-    return 1;
-  }
-  // fake directory 
-  while (de->de_ino == 0) {
-    if (inode.i_size <= *off_p) {
-      return 0;
-    }
-    ext2_read(ino, de, *off_p, de_name_offset);
-    ext2_read(ino, de->de_name, *off_p + de_name_offset, de->de_namelen);
-    *off_p += de->de_reclen;
-  }
-  de->de_name[de->de_namelen] = '\0';
-  return 1;
-#endif /* !STUDENT */
-  return 0;
+
+  ext2_dir_close(&dir);
+  return found;
 }
 
 /* Read the target of a symbolic link identified by `ino` i-node into buffer
@@ -431,28 +2538,31 @@ int ext2_readdir(uint32_t ino, uint32_t *off_p, ext2_dirent_t *de) {
 int ext2_readlink(uint32_t ino, char *buf, size_t buflen) {
   int error;
 
-  ext2_inode_t inode;
-  if ((error = ext2_inode_read(ino, &inode)))
+  icache_t *ic;
+  if ((error = inode_get(ino, &ic)))
     return error;
+  ext2_inode_t *inode = &ic->ic_inode;
 
     /* Check if it's a symlink and read it. */
 #ifdef STUDENT
   /* TODO */
-  if ((inode.i_mode & EXT2_IFLNK) == 0 || inode.i_size > buflen) {
-    return EINVAL;
+  if ((inode->i_mode & EXT2_IFMT) != EXT2_IFLNK || inode->i_size > buflen) {
+    error = EINVAL;
   }
   // panic("Wrong size");
 
   // short
-  if (inode.i_size < EXT2_MAXSYMLINKLEN) {
-    memcpy(buf, inode.i_blocks, inode.i_size);
-    return 0;
+  else if (inode->i_size < EXT2_MAXSYMLINKLEN) {
+    memcpy(buf, inode->i_blocks, inode->i_size);
   }
   // long
   else {
-    return ext2_read(ino, buf, 0, inode.i_size);
+    error = ext2_read(ino, buf, 0, inode->i_size);
   }
+  inode_put(ic);
+  return error;
 #endif /* !STUDENT */
+  inode_put(ic);
   return ENOTSUP;
 }
 
@@ -461,34 +2571,580 @@ int ext2_readlink(uint32_t ino, char *buf, size_t buflen) {
 int ext2_stat(uint32_t ino, struct stat *st) {
   int error;
 
-  ext2_inode_t inode;
-  if ((error = ext2_inode_read(ino, &inode)))
+  icache_t *ic;
+  if ((error = inode_get(ino, &ic)))
     return error;
+  ext2_inode_t *inode = &ic->ic_inode;
 
     /* Convert the metadata! */
 #ifdef STUDENT
   /* TODO */
   st->st_ino = ino;
-  st->st_mode = inode.i_mode;
-  st->st_nlink = inode.i_nlink;
-  st->st_uid = inode.i_uid;
-  st->st_gid = inode.i_gid;
-  st->st_size = inode.i_size;
-  st->st_blksize = BLKSIZE;
-  st->st_blocks = inode.i_nblock;
-  st->st_atim.tv_sec = inode.i_atime;
-  st->st_mtim.tv_sec = inode.i_mtime;
-  st->st_ctim.tv_sec = inode.i_ctime;
+  st->st_mode = inode->i_mode;
+  st->st_nlink = inode->i_nlink;
+  st->st_uid = inode->i_uid;
+  st->st_gid = inode->i_gid;
+  st->st_size = inode->i_size;
+  st->st_blksize = blksize;
+  st->st_blocks = inode->i_nblock;
+  st->st_atim.tv_sec = inode->i_atime;
+  st->st_mtim.tv_sec = inode->i_mtime;
+  st->st_ctim.tv_sec = inode->i_ctime;
+  inode_put(ic);
   return 0;
 #endif /* !STUDENT */
+  inode_put(ic);
   return ENOTSUP;
 }
 
+/*
+ * Directory lookup routines.
+ */
+
+/* Computes hash value of `len` bytes long `name` (32-bit FNV-1a). */
+static uint32_t hashname(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Initializes directory entry cache and directory indices. */
+static int dcache_init(void) {
+  dentries_mask = roundup_pow2(DENTRIES_PER_INODE * ninodes) - 1;
+  if (!(dentries = calloc(dentries_mask + 1, sizeof(dentry_t))))
+    return ENOMEM;
+
+  pthread_mutex_init(&dxlock, NULL);
+  pthread_cond_init(&dxcv, NULL);
+
+  TAILQ_INIT(&dxlrulst);
+  for (int i = 0; i < NDIRINDEX; i++)
+    TAILQ_INSERT_TAIL(&dxlrulst, &dirindex[i], dx_link);
+
+  return 0;
+}
+
+static dentry_t *dcache_slot(uint32_t parent, uint32_t hash) {
+  return &dentries[hash2(parent, hash) & dentries_mask];
+}
+
+/* Inserts entry into hash table of directory index `dx`. */
+static void dirindex_insert(dirindex_t *dx, dxent_t *ent) {
+  size_t i = ent->dx_hash & dx->dx_mask;
+  while (dx->dx_table[i].dx_ino != 0)
+    i = (i + 1) & dx->dx_mask;
+  dx->dx_table[i] = *ent;
+}
+
+/* Reads all entries of `ino` directory of `size` bytes into index `dx`. */
+static int dirindex_build(dirindex_t *dx, uint32_t ino, size_t size) {
+  /* Each directory entry takes at least 12 bytes. */
+  size_t maxents = size / EXT2_DIRSIZE(1) + 1;
+  dxent_t *ents = malloc(maxents * sizeof(dxent_t));
+  char *names = malloc(size + 1);
+  size_t nents = 0, namesz = 0;
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+  int error;
+
+  if (ents == NULL || names == NULL) {
+    error = ENOMEM;
+    goto fail;
+  }
+
+  if ((error = ext2_dir_open(ino, 0, &dir)))
+    goto fail;
+
+  while (nents < maxents && ext2_dir_next(&dir, &dv)) {
+    dxent_t *ent = &ents[nents++];
+    ent->dx_hash = hashname(dv.dv_name, dv.dv_namelen);
+    ent->dx_ino = dv.dv_ino;
+    ent->dx_nameoff = namesz;
+    ent->dx_namelen = dv.dv_namelen;
+    ent->dx_type = dv.dv_type;
+    memcpy(names + namesz, dv.dv_name, dv.dv_namelen);
+    namesz += dv.dv_namelen;
+  }
+
+  ext2_dir_close(&dir);
+
+  dx->dx_mask = roundup_pow2(2 * nents + 1) - 1;
+  if (!(dx->dx_table = calloc(dx->dx_mask + 1, sizeof(dxent_t)))) {
+    error = ENOMEM;
+    goto fail;
+  }
+
+  for (size_t i = 0; i < nents; i++)
+    dirindex_insert(dx, &ents[i]);
+
+  STAT_INC(dc_indexed);
+  dx->dx_names = names;
+  free(ents);
+  return 0;
+
+fail:
+  free(ents);
+  free(names);
+  return error;
+}
+
+/* Returns index of `ino` directory of `size` bytes. If there's none, then
+ * least recently used index is replaced. The index must be released with
+ * `dirindex_put` when no longer needed. */
+static int dirindex_get(uint32_t ino, size_t size, dirindex_t **dxp) {
+  dirindex_t *dx;
+  int error;
+
+  pthread_mutex_lock(&dxlock);
+
+  for (;;) {
+    TAILQ_FOREACH (dx, &dxlrulst, dx_link) {
+      if (dx->dx_ino == ino)
+        break;
+    }
+
+    if (dx != NULL) {
+      dx->dx_refcnt++;
+      /* Another thread is building the index, wait for it. */
+      while (dx->dx_building)
+        pthread_cond_wait(&dxcv, &dxlock);
+      if (dx->dx_ino == ino) {
+        TAILQ_REMOVE(&dxlrulst, dx, dx_link);
+        TAILQ_INSERT_HEAD(&dxlrulst, dx, dx_link);
+        pthread_mutex_unlock(&dxlock);
+        *dxp = dx;
+        return 0;
+      }
+      /* Building the index failed, so let's try on our own. */
+      dx->dx_refcnt--;
+      continue;
+    }
+
+    /* Replace least recently used index that nobody uses. */
+    TAILQ_FOREACH_REVERSE(dx, &dxlrulst, dirindex_list, dx_link) {
+      if (dx->dx_refcnt == 0)
+        break;
+    }
+
+    if (dx != NULL)
+      break;
+
+    pthread_cond_wait(&dxcv, &dxlock);
+  }
+
+  dxent_t *table = dx->dx_table;
+  char *names = dx->dx_names;
+  dx->dx_ino = ino;
+  dx->dx_table = NULL;
+  dx->dx_names = NULL;
+  dx->dx_refcnt = 1;
+  dx->dx_building = true;
+  TAILQ_REMOVE(&dxlrulst, dx, dx_link);
+  TAILQ_INSERT_HEAD(&dxlrulst, dx, dx_link);
+
+  /* Do not hold the lock while reading the directory. */
+  pthread_mutex_unlock(&dxlock);
+  free(table);
+  free(names);
+  error = dirindex_build(dx, ino, size);
+  pthread_mutex_lock(&dxlock);
+
+  dx->dx_building = false;
+  if (error) {
+    dx->dx_ino = 0;
+    dx->dx_refcnt--;
+  }
+  pthread_cond_broadcast(&dxcv);
+  pthread_mutex_unlock(&dxlock);
+
+  if (error)
+    return error;
+  *dxp = dx;
+  return 0;
+}
+
+/* Releases directory index. */
+static void dirindex_put(dirindex_t *dx) {
+  pthread_mutex_lock(&dxlock);
+  assert(dx->dx_refcnt > 0);
+  if (--dx->dx_refcnt == 0)
+    pthread_cond_broadcast(&dxcv);
+  pthread_mutex_unlock(&dxlock);
+}
+
+/* Looks up `name` of `len` bytes with `hash` value in directory index. */
+static dxent_t *dirindex_lookup(dirindex_t *dx, const char *name, size_t len,
+                                uint32_t hash) {
+  for (size_t i = hash & dx->dx_mask;; i = (i + 1) & dx->dx_mask) {
+    dxent_t *ent = &dx->dx_table[i];
+    if (ent->dx_ino == 0)
+      return NULL;
+    if (ent->dx_hash == hash && ent->dx_namelen == len &&
+        !memcmp(dx->dx_names + ent->dx_nameoff, name, len))
+      return ent;
+  }
+}
+
+/* Looks up `name` of `len` bytes with `hash` value in `ino` directory using
+ * the metadata index. Returns false if the index cannot answer, otherwise
+ * stores i-node number (0 if there's no such entry) and file type. */
+static bool index_lookup(uint32_t ino, const char *name, size_t len,
+                         uint32_t hash, uint32_t *inop, uint8_t *typep) {
+  const ixinode_t *ii;
+
+  if (ix_map == NULL || !(ii = index_inode(ino)) || (ii->ii_flags & IX_NODENTS))
+    return false;
+
+  STAT_INC(ix_hits);
+
+  /* Find the first entry with matching parent and hash. */
+  uint32_t lo = 0, hi = ixkey.ih_ndents;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const ixdent_t *id = &ix_dents[mid];
+    if (id->id_parent < ino || (id->id_parent == ino && id->id_hash < hash))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < ixkey.ih_ndents; lo++) {
+    const ixdent_t *id = &ix_dents[lo];
+    if (id->id_parent != ino || id->id_hash != hash)
+      break;
+    if (id->id_namelen == len &&
+        !memcmp(ix_names + id->id_nameoff, name, len)) {
+      *inop = id->id_ino;
+      *typep = id->id_type;
+      return true;
+    }
+  }
+
+  return true;
+}
+
+/* Hash functions of directory hash tree, as defined by Linux ext2 driver. */
+
+/* Packs up to `num` words of `msg` into `buf`, padding with length. */
+static void dx_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num,
+                           bool unsign) {
+  uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+  pad |= pad << 16;
+
+  uint32_t val = pad;
+  len = min(len, (size_t)num * 4);
+  for (size_t i = 0; i < len; i++) {
+    int c = unsign ? (int)(uint8_t)msg[i] : (int)(int8_t)msg[i];
+    val = c + (val << 8);
+    if (i % 4 == 3) {
+      *buf++ = val;
+      val = pad;
+      num--;
+    }
+  }
+  if (--num >= 0)
+    *buf++ = val;
+  while (--num >= 0)
+    *buf++ = pad;
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+
+#define DX_K1 0
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+/* Basic cut-down MD4 transform. */
+static void dx_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+  uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+  DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1, 3);
+  DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1, 7);
+  DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+  DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1, 3);
+  DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1, 7);
+  DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+  DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+  DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+  DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+  DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+  DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+  DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+  DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+  DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+  DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+  DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+  DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+  DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+  DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+  DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+  DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+  DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+  buf[0] += a;
+  buf[1] += b;
+  buf[2] += c;
+  buf[3] += d;
+}
+
+/* Tiny Encryption Algorithm with 16 rounds. */
+static void dx_tea(uint32_t buf[4], const uint32_t in[4]) {
+  uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+  uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+  for (int n = 0; n < 16; n++) {
+    sum += 0x9E3779B9;
+    b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  }
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* The original hash function, which is used by very old filesystems. */
+static uint32_t dx_hack_hash(const char *name, size_t len, bool unsign) {
+  uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+  for (size_t i = 0; i < len; i++) {
+    int c = unsign ? (int)(uint8_t)name[i] : (int)(int8_t)name[i];
+    hash = hash1 + (hash0 ^ (c * 7152373));
+    if (hash & 0x80000000)
+      hash -= 0x7fffffff;
+    hash1 = hash0;
+    hash0 = hash;
+  }
+
+  return hash0 << 1;
+}
+
+/* Computes hash value of `name` with `version` hash function. Lowest bit is
+ * cleared, as the tree uses it to mark blocks that continue a hash value.
+ * Returns false if the hash function is unknown. */
+static bool dx_hash(unsigned version, const char *name, size_t len,
+                    uint32_t *hashp) {
+  uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  uint32_t in[8], hash;
+
+  if (dx_seed[0] | dx_seed[1] | dx_seed[2] | dx_seed[3])
+    memcpy(buf, dx_seed, sizeof(buf));
+
+  switch (version) {
+    case EXT2_DX_HASH_LEGACY:
+    case EXT2_DX_HASH_LEGACY_UNSIGNED:
+      hash = dx_hack_hash(name, len, version == EXT2_DX_HASH_LEGACY_UNSIGNED);
+      break;
+    case EXT2_DX_HASH_HALF_MD4:
+    case EXT2_DX_HASH_HALF_MD4_UNSIGNED:
+      for (size_t i = 0; i < len; i += 32) {
+        dx_str2hashbuf(name + i, len - i, in, 8,
+                       version == EXT2_DX_HASH_HALF_MD4_UNSIGNED);
+        dx_half_md4(buf, in);
+      }
+      hash = buf[1];
+      break;
+    case EXT2_DX_HASH_TEA:
+    case EXT2_DX_HASH_TEA_UNSIGNED:
+      for (size_t i = 0; i < len; i += 16) {
+        dx_str2hashbuf(name + i, len - i, in, 4,
+                       version == EXT2_DX_HASH_TEA_UNSIGNED);
+        dx_tea(buf, in);
+      }
+      hash = buf[0];
+      break;
+    default:
+      return false;
+  }
+
+  hash &= ~1;
+  /* The largest value marks end of directory for readdir. */
+  if (hash == 0x7fffffffU << 1)
+    hash = (0x7fffffffU - 1) << 1;
+  *hashp = hash;
+  return true;
+}
+
+/* Position in a node of directory hash tree. */
+typedef struct dxframe {
+  blk_t *df_blk;               /* pinned node block */
+  ext2_dxentry_t *df_entries;  /* entries of the node */
+  unsigned df_count;           /* number of entries */
+  unsigned df_at;              /* entry that is being followed */
+} dxframe_t;
+
+/* Reads `idx` block of `ino` directory that has `nblks` blocks as a node of
+ * hash tree, with entries starting at `off`. Returns false if the node seems
+ * to be corrupted. */
+static bool htree_node(uint32_t ino, uint32_t nblks, uint32_t idx, size_t off,
+                       dxframe_t *df) {
+  if (idx >= nblks)
+    return false;
+
+  blk_t *blk = blk_get(ino, idx);
+  if (blk == NULL || blk == BLK_ZERO)
+    return false;
+
+  ext2_dxentry_t *entries = blk->b_data + off;
+  unsigned count = dx_count(entries);
+  if (count == 0 || count > dx_limit(entries) ||
+      off + count * sizeof(ext2_dxentry_t) > blksize) {
+    blk_put(blk);
+    return false;
+  }
+
+  *df = (dxframe_t){
+    .df_blk = blk, .df_entries = entries, .df_count = count, .df_at = 0};
+  return true;
+}
+
+/* Follows entry of `df` node that covers `hash`. */
+static void htree_search(dxframe_t *df, uint32_t hash) {
+  unsigned lo = 1, hi = df->df_count;
+
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if (df->df_entries[mid].dx_hash > hash)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  df->df_at = lo - 1;
+}
+
+#define dx_block(df) ((df)->df_entries[(df)->df_at].dx_block & 0x0fffffff)
+
+/* Looks up `name` in leaf block `idx` of `ino` directory. */
+static bool htree_leaf(uint32_t ino, uint32_t idx, const char *name, size_t len,
+                       uint32_t *inop, uint8_t *typep) {
+  blk_t *blk = blk_get(ino, idx);
+  bool found = false;
+
+  if (blk == NULL || blk == BLK_ZERO)
+    return false;
+
+  for (size_t off = 0; off + EXT2_DIRSIZE(0) <= blksize;) {
+    ext2_dirent_t *de = blk->b_data + off;
+    if (de->de_reclen < EXT2_DIRSIZE(0) || de->de_reclen > blksize - off ||
+        EXT2_DIRSIZE(de->de_namelen) > de->de_reclen)
+      break;
+    if (de->de_ino != 0 && de->de_namelen == len &&
+        !memcmp(de->de_name, name, len)) {
+      *inop = de->de_ino;
+      *typep = de->de_type;
+      found = true;
+      break;
+    }
+    off += de->de_reclen;
+  }
+
+  blk_put(blk);
+  return found;
+}
+
+/* Looks up `name` of `len` bytes in `ino` directory of `size` bytes using its
+ * hash tree. Only the blocks on the path from the root to the leaf that holds
+ * the name are read, or a few more if many names have the same hash value.
+ * Returns 0 and stores i-node number (0 if there's no such entry) and file
+ * type, or EINVAL if the tree is corrupted or of unknown kind, in which case
+ * the directory should be searched as if it had no index. */
+static int htree_lookup(uint32_t ino, size_t size, const char *name,
+                        size_t len, uint32_t *inop, uint8_t *typep) {
+  uint32_t nblks = howmany(size, blksize);
+  dxframe_t frames[EXT2_DX_MAXLEVELS];
+  unsigned depth = 0;
+  uint32_t hash;
+  int error = EINVAL;
+
+  /* Dot entries are kept in the root block, in front of the tree. */
+  if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+    return htree_leaf(ino, 0, name, len, inop, typep) ? 0 : EINVAL;
+
+  blk_t *blk = blk_get(ino, 0);
+  if (blk == NULL || blk == BLK_ZERO)
+    return EINVAL;
+
+  ext2_dxroot_t root = *(ext2_dxroot_t *)(blk->b_data + EXT2_DX_ROOT_OFF);
+  blk_put(blk);
+
+  unsigned version = root.dr_hash_version;
+  if (version <= EXT2_DX_HASH_TEA)
+    version += dx_unsigned;
+
+  if (root.dr_zero != 0 || root.dr_info_length != sizeof(ext2_dxroot_t) ||
+      root.dr_levels >= EXT2_DX_MAXLEVELS ||
+      !dx_hash(version, name, len, &hash))
+    return EINVAL;
+
+  STAT_INC(dc_htree);
+
+  /* Descend from the root to the leaf that may hold the name. */
+  if (!htree_node(ino, nblks, 0, EXT2_DX_ROOT_OFF + sizeof(ext2_dxroot_t),
+                  &frames[0]))
+    return EINVAL;
+  htree_search(&frames[0], hash);
+
+  for (depth = 1; depth <= root.dr_levels; depth++) {
+    if (!htree_node(ino, nblks, dx_block(&frames[depth - 1]), EXT2_DX_NODE_OFF,
+                    &frames[depth]))
+      goto done;
+    htree_search(&frames[depth], hash);
+  }
+
+  for (;;) {
+    dxframe_t *df = &frames[depth - 1];
+    if (dx_block(df) >= nblks)
+      goto done;
+
+    if (htree_leaf(ino, dx_block(df), name, len, inop, typep))
+      break;
+
+    /* Names with the same hash value may continue in the next leaf, which is
+     * marked by the lowest bit of its hash value. Find the next leaf. */
+    int i = depth - 1;
+    while (i >= 0 && ++frames[i].df_at == frames[i].df_count)
+      i--;
+    if (i < 0 || (frames[i].df_entries[frames[i].df_at].dx_hash & ~1) != hash) {
+      *inop = 0;
+      break;
+    }
+
+    for (unsigned j = i + 1; j < depth; j++)
+      blk_put(frames[j].df_blk);
+    for (unsigned j = i + 1; j < depth; j++) {
+      if (!htree_node(ino, nblks, dx_block(&frames[j - 1]), EXT2_DX_NODE_OFF,
+                      &frames[j])) {
+        depth = j;
+        goto done;
+      }
+    }
+  }
+
+  error = 0;
+
+done:
+  for (unsigned i = 0; i < depth; i++)
+    blk_put(frames[i].df_blk);
+  return error;
+}
+
 /* Reads file identified by `ino` i-node as directory and performs a lookup of
  * `name` entry. If an entry is found, its i-inode number is stored in `ino_p`
- * and its type in stored in `type_p`. On success returns 0, or EINVAL if `name`
- * is NULL or zero length, or ENOTDIR is `ino` file is not a directory, or
- * ENOENT if no entry was found. */
+ * and its type in stored in `type_p` (unless it's NULL). On success returns 0,
+ * or EINVAL if `name` is NULL or zero length, or ENOTDIR is `ino` file is not
+ * a directory, or ENOENT if no entry was found. */
 int ext2_lookup(uint32_t ino, const char *name, uint32_t *ino_p,
                 uint8_t *type_p) {
   int error;
@@ -496,51 +3152,402 @@ int ext2_lookup(uint32_t ino, const char *name, uint32_t *ino_p,
   if (name == NULL || !strlen(name))
     return EINVAL;
 
-  ext2_inode_t inode;
-  if ((error = ext2_inode_read(ino, &inode)))
+  icache_t *ic;
+  if ((error = inode_get(ino, &ic)))
     return error;
+  uint16_t mode = ic->ic_inode.i_mode;
+  size_t size = ic->ic_inode.i_size;
+  bool indexed = dx_enabled && (ic->ic_inode.i_flags & EXT2_INDEX_FL);
+  inode_put(ic);
 
-#ifdef STUDENT
-  /* TODO */
-  if ((EXT2_IFDIR & inode.i_mode) == 0) {
+  if ((mode & EXT2_IFMT) != EXT2_IFDIR)
     return ENOTDIR;
+
+  size_t len = strlen(name);
+  if (len > EXT2_MAXNAMLEN)
+    return ENOENT;
+
+  uint32_t hash = hashname(name, len);
+  uint32_t found_ino = 0;
+  uint8_t found_type = EXT2_FT_UNKNOWN;
+
+  /* Positive and negative answers are kept in directory entry cache. */
+  dentry_t *d = dcache_slot(ino, hash);
+  dentry_t copy;
+  uint32_t seq;
+  bool hit = false;
+
+  if (seqlock_read_begin(&d->d_seq, &seq)) {
+    seqlock_copy(&copy, d, sizeof(dentry_t));
+    hit = seqlock_read_valid(&d->d_seq, seq) && copy.d_parent == ino &&
+          copy.d_hash == hash && copy.d_namelen == len &&
+          !memcmp(copy.d_name, name, len);
   }
 
-  uint32_t offset = 0;
-  ext2_dirent_t entry;
-  int available = ext2_readdir(ino, &offset, &entry);
-  int name_length, entry_name_len;
+  if (hit) {
+    STAT_INC(dc_hits);
+    found_ino = copy.d_ino;
+    found_type = copy.d_type;
+  } else {
+    STAT_INC(dc_misses);
+
+    if (!index_lookup(ino, name, len, hash, &found_ino, &found_type) &&
+        (!indexed ||
+         htree_lookup(ino, size, name, len, &found_ino, &found_type))) {
+      dirindex_t *dx;
+      if ((error = dirindex_get(ino, size, &dx)))
+        return error;
+
+      dxent_t *ent = dirindex_lookup(dx, name, len, hash);
+      if (ent != NULL) {
+        found_ino = ent->dx_ino;
+        found_type = ent->dx_type;
+      }
 
-  while (available) {
-    name_length = strlen(name);
-    entry_name_len = entry.de_namelen;
-    // for safety
-    if (name_length == entry_name_len) {
-      if (strcmp(name, entry.de_name) == 0) {
-        *ino_p = entry.de_ino;
-        *type_p = entry.de_type;
-        return 0;
+      dirindex_put(dx);
+    }
+
+    if (len <= DNAME_INLINE_LEN && seqlock_write_begin(&d->d_seq, &seq)) {
+      memset(&copy, 0, sizeof(dentry_t));
+      copy.d_parent = ino;
+      copy.d_hash = hash;
+      copy.d_ino = found_ino;
+      copy.d_type = found_type;
+      copy.d_namelen = len;
+      memcpy(copy.d_name, name, len);
+      /* Sequence number is the first word, so it is not overwritten. */
+      seqlock_copy(&d->d_parent, &copy.d_parent,
+                   sizeof(dentry_t) - offsetof(dentry_t, d_parent));
+      seqlock_write_end(&d->d_seq, seq);
+    }
+  }
+
+  if (found_ino == 0)
+    return ENOENT;
+
+  *ino_p = found_ino;
+  if (type_p != NULL)
+    *type_p = found_type;
+  return 0;
+}
+
+/*
+ * Metadata index routines.
+ */
+
+/* Growable buffer that index sections are built in. */
+typedef struct ixbuf {
+  char *ib_data;  /* contents */
+  size_t ib_len;  /* number of bytes used */
+  size_t ib_size; /* capacity of `ib_data` */
+} ixbuf_t;
+
+/* Appends `len` zeroed bytes to `ib` and returns pointer to them, or NULL if
+ * out of memory. The pointer is valid until next append. */
+static void *ixbuf_append(ixbuf_t *ib, size_t len) {
+  if (ib->ib_len + len > ib->ib_size) {
+    size_t size = max(ib->ib_size * 2, ib->ib_len + len + 4096);
+    char *data = realloc(ib->ib_data, size);
+    if (data == NULL)
+      return NULL;
+    ib->ib_data = data;
+    ib->ib_size = size;
+  }
+
+  void *p = ib->ib_data + ib->ib_len;
+  memset(p, 0, len);
+  ib->ib_len += len;
+  return p;
+}
+
+static int ixdent_cmp(const void *a, const void *b) {
+  const ixdent_t *x = a, *y = b;
+  if (x->id_parent != y->id_parent)
+    return x->id_parent < y->id_parent ? -1 : 1;
+  if (x->id_hash != y->id_hash)
+    return x->id_hash < y->id_hash ? -1 : 1;
+  return 0;
+}
+
+/* Appends entries of `ino` directory to `dents` and their names to `names`. */
+static int index_dir(uint32_t ino, ixbuf_t *dents, ixbuf_t *names) {
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+  int error;
+
+  if ((error = ext2_dir_open(ino, 0, &dir)))
+    return error;
+
+  while (ext2_dir_next(&dir, &dv)) {
+    ixdent_t *id = ixbuf_append(dents, sizeof(ixdent_t));
+    char *name = ixbuf_append(names, dv.dv_namelen);
+    if (id == NULL || name == NULL) {
+      error = ENOMEM;
+      break;
+    }
+    id->id_parent = ino;
+    id->id_hash = hashname(dv.dv_name, dv.dv_namelen);
+    id->id_ino = dv.dv_ino;
+    id->id_nameoff = name - names->ib_data;
+    id->id_namelen = dv.dv_namelen;
+    id->id_type = dv.dv_type;
+    memcpy(name, dv.dv_name, dv.dv_namelen);
+  }
+
+  ext2_dir_close(&dir);
+  return error;
+}
+
+/* Writes `len` bytes from `data` at `off` offset of `fd` file. */
+static int index_write(int fd, const void *data, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, data, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return errno;
+    data += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Builds metadata index of mounted filesystem and writes it to `path` file.
+ * Every allocated i-node is read together with its block map and, if it's a
+ * directory, its entries, so it takes as long as listing the whole tree.
+ * The file is replaced atomically. Returns 0 on success or error. */
+int ext2_index_save(const char *path) {
+  ixbuf_t inodes = {0}, extents = {0}, dents = {0}, names = {0};
+  int error = 0;
+
+  for (long ino = ext2_inode_find(1, 1); ino > 0 && !error;
+       ino = (size_t)ino < inode_count ? ext2_inode_find(ino + 1, 1) : -1) {
+    icache_t *ic;
+    if (inode_get(ino, &ic))
+      continue;
+
+    ixinode_t *ii = ixbuf_append(&inodes, sizeof(ixinode_t));
+    if (ii == NULL) {
+      inode_put(ic);
+      error = ENOMEM;
+      break;
+    }
+
+    ii->ii_ino = ino;
+    ii->ii_inode = ic->ic_inode;
+
+    extent_t *ext;
+    uint32_t n;
+    if (inode_bmap(ic, &ext, &n)) {
+      ii->ii_flags |= IX_NOMAP;
+    } else if (n > 0) {
+      void *p = ixbuf_append(&extents, n * sizeof(extent_t));
+      if (p == NULL)
+        error = ENOMEM;
+      else
+        memcpy(p, ext, n * sizeof(extent_t));
+      ii->ii_extent = extents.ib_len / sizeof(extent_t) - n;
+      ii->ii_nextents = n;
+    }
+
+    bool isdir = (ic->ic_inode.i_mode & EXT2_IFMT) == EXT2_IFDIR;
+    inode_put(ic);
+
+    if (!error && isdir) {
+      size_t ndents = dents.ib_len, namesz = names.ib_len;
+      if ((error = index_dir(ino, &dents, &names))) {
+        /* Lookups in this directory will read it from the image. */
+        ii->ii_flags |= IX_NODENTS;
+        dents.ib_len = ndents;
+        names.ib_len = namesz;
+        if (error != ENOMEM)
+          error = 0;
       }
     }
-    available = ext2_readdir(ino, &offset, &entry);
   }
 
-#endif /* !STUDENT */
+  if (!error && names.ib_len > UINT32_MAX)
+    error = EFBIG;
+
+  char tmppath[strlen(path) + 8];
+  int fd = -1;
+
+  if (!error) {
+    sprintf(tmppath, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmppath)) < 0)
+      error = errno;
+  }
+
+  if (!error) {
+    qsort(dents.ib_data, dents.ib_len / sizeof(ixdent_t), sizeof(ixdent_t),
+          ixdent_cmp);
+
+    ixhdr_t hdr = ixkey;
+    hdr.ih_ninodes = inodes.ib_len / sizeof(ixinode_t);
+    hdr.ih_nextents = extents.ib_len / sizeof(extent_t);
+    hdr.ih_ndents = dents.ib_len / sizeof(ixdent_t);
+    hdr.ih_namesz = names.ib_len;
+    hdr.ih_inodes = roundup2(sizeof(ixhdr_t), 8);
+    hdr.ih_extents = roundup2(hdr.ih_inodes + inodes.ib_len, 8);
+    hdr.ih_dents = roundup2(hdr.ih_extents + extents.ib_len, 8);
+    hdr.ih_names = roundup2(hdr.ih_dents + dents.ib_len, 8);
+
+    if (!(error = index_write(fd, &hdr, sizeof(hdr), 0)) &&
+        !(error = index_write(fd, inodes.ib_data, inodes.ib_len,
+                              hdr.ih_inodes)) &&
+        !(error = index_write(fd, extents.ib_data, extents.ib_len,
+                              hdr.ih_extents)) &&
+        !(error = index_write(fd, dents.ib_data, dents.ib_len,
+                              hdr.ih_dents)) &&
+        !(error = index_write(fd, names.ib_data, names.ib_len,
+                              hdr.ih_names))) {
+      /* Make sure the data is on disk before the index gets its name. */
+      if (fchmod(fd, 0644) || fsync(fd) || rename(tmppath, path))
+        error = errno;
+    }
+
+    close(fd);
+    if (error)
+      unlink(tmppath);
+  }
+
+  free(inodes.ib_data);
+  free(extents.ib_data);
+  free(dents.ib_data);
+  free(names.ib_data);
+  return error;
+}
+
+/* Checks if section of `n` items of `size` bytes at `off` fits in the index
+ * of `ixsize` bytes. */
+static bool index_section_ok(size_t ixsize, uint64_t off, uint64_t n,
+                             size_t size) {
+  return off % 8 == 0 && off <= ixsize && n <= (ixsize - off) / size;
+}
+
+/* Checks if `n` runs from `extents` make a block map like `bmap_decode` does:
+ * consecutive runs that start at block index 0 and point into the
+ * filesystem. Otherwise lookups could read past the end of the image. */
+static bool index_extents_ok(const extent_t *extents, uint32_t n) {
+  uint64_t next = 0;
+
+  for (uint32_t i = 0; i < n; i++) {
+    const extent_t *e = &extents[i];
+    if (e->e_index != next || e->e_count == 0 ||
+        (e->e_blkaddr != 0 &&
+         (uint64_t)e->e_blkaddr + e->e_count > block_count))
+      return false;
+    next += e->e_count;
+  }
+
+  return next <= UINT32_MAX;
+}
+
+/* Loads metadata index from `path` file written by `ext2_index_save`. It must
+ * be called after `ext2_mount` and before any other function. Returns 0 on
+ * success, ESTALE if the index was built for different image, EINVAL if it's
+ * damaged, or error if it could not be read. */
+int ext2_index_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return errno;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return errno;
+  }
+
+  size_t size = st.st_size;
+  if (size < sizeof(ixhdr_t)) {
+    close(fd);
+    return EINVAL;
+  }
 
-  return ENOENT;
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return errno;
+
+  const ixhdr_t *hdr = map;
+  const ixinode_t *inodes = map + hdr->ih_inodes;
+  const extent_t *extents = map + hdr->ih_extents;
+  const ixdent_t *dents = map + hdr->ih_dents;
+  int error = 0;
+
+  if (hdr->ih_magic != IX_MAGIC || hdr->ih_version != IX_VERSION) {
+    error = EINVAL;
+  } else if (hdr->ih_imgsize != ixkey.ih_imgsize ||
+             hdr->ih_imgmtime != ixkey.ih_imgmtime ||
+             hdr->ih_sbhash != ixkey.ih_sbhash) {
+    error = ESTALE;
+  } else if (!index_section_ok(size, hdr->ih_inodes, hdr->ih_ninodes,
+                               sizeof(ixinode_t)) ||
+             !index_section_ok(size, hdr->ih_extents, hdr->ih_nextents,
+                               sizeof(extent_t)) ||
+             !index_section_ok(size, hdr->ih_dents, hdr->ih_ndents,
+                               sizeof(ixdent_t)) ||
+             !index_section_ok(size, hdr->ih_names, hdr->ih_namesz, 1)) {
+    error = EINVAL;
+  }
+
+  /* Entries are used without further checks, so verify them now. */
+  for (uint32_t i = 0; !error && i < hdr->ih_ninodes; i++) {
+    const ixinode_t *ii = &inodes[i];
+    if ((i > 0 && ii->ii_ino <= inodes[i - 1].ii_ino) ||
+        ii->ii_ino > inode_count ||
+        ii->ii_extent > hdr->ih_nextents ||
+        ii->ii_nextents > hdr->ih_nextents - ii->ii_extent ||
+        !index_extents_ok(&extents[ii->ii_extent], ii->ii_nextents))
+      error = EINVAL;
+  }
+
+  for (uint32_t i = 0; !error && i < hdr->ih_ndents; i++) {
+    const ixdent_t *id = &dents[i];
+    if ((i > 0 && ixdent_cmp(&dents[i - 1], id) > 0) ||
+        id->id_nameoff > hdr->ih_namesz ||
+        id->id_namelen > hdr->ih_namesz - id->id_nameoff)
+      error = EINVAL;
+  }
+
+  if (error) {
+    munmap(map, size);
+    return error;
+  }
+
+  ixkey = *hdr;
+  ix_size = size;
+  ix_inodes = inodes;
+  ix_extents = extents;
+  ix_dents = dents;
+  ix_names = map + hdr->ih_names;
+  ix_map = map;
+  return 0;
 }
 
-/* Initializes ext2 filesystem stored in `fspath` file.
+/* Initializes ext2 filesystem stored in `fspath` file with default options.
  * Returns 0 on success, otherwise an error. */
 int ext2_mount(const char *fspath) {
+  ext2_mntopts_t opts = {.flags = 0, .nbufs = 0, .ninodes = 0};
+  return ext2_mount_opts(fspath, &opts);
+}
+
+/* Initializes ext2 filesystem stored in `fspath` file. Options in `opts`
+ * select how the image is accessed and how big the caches are. Returns 0 on
+ * success, otherwise an error. */
+int ext2_mount_opts(const char *fspath, const ext2_mntopts_t *opts) {
   int error;
 
-  if ((error = blk_init(fspath)))
+  if ((error = blk_open(fspath, opts->flags)))
     return error;
 
-  /* Read superblock and verify we support filesystem's features. */
+  /* Read superblock and verify we support filesystem's features. Block size
+   * is not known yet, so it's read without buffer cache. */
   ext2_superblock_t sb;
-  ext2_read(0, &sb, EXT2_SBOFF, sizeof(ext2_superblock_t));
+  if (pread(fd_ext2, &sb, sizeof(ext2_superblock_t), EXT2_SBOFF) !=
+      sizeof(ext2_superblock_t))
+    panic("'%s' cannot be identified as ext2 filesystem!", fspath);
 
   debug(">>> super block\n"
         "# of inodes      : %d\n"
@@ -549,21 +3556,56 @@ int ext2_mount(const char *fspath) {
         "blocks per group : %d\n"
         "inodes per group : %d\n"
         "inode size       : %d\n",
-        sb.sb_icount, sb.sb_bcount, 1024UL << sb.sb_log_bsize, sb.sb_bpg,
-        sb.sb_ipg, sb.sb_inode_size);
+        sb.sb_icount, sb.sb_bcount, ext2_blksize(&sb), sb.sb_bpg, sb.sb_ipg,
+        sb.sb_inode_size);
 
   if (sb.sb_magic != EXT2_MAGIC)
     panic("'%s' cannot be identified as ext2 filesystem!", fspath);
 
+  /* Metadata index is valid only for this very image. */
+  struct stat st;
+  if (fstat(fd_ext2, &st) < 0)
+    return errno;
+  ixkey = (ixhdr_t){
+    .ih_magic = IX_MAGIC,
+    .ih_version = IX_VERSION,
+    .ih_imgsize = st.st_size,
+    .ih_imgmtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+    .ih_sbhash = hashname((const char *)&sb, sizeof(sb)),
+  };
+
   if (sb.sb_rev != EXT2_REV1)
     panic("Only ext2 revision 1 is supported!");
 
-  size_t blksize = 1024UL << sb.sb_log_bsize;
-  if (blksize != BLKSIZE)
-    panic("ext2 filesystem with block size %ld not supported!", blksize);
+  if (sb.sb_log_bsize > EXT2_MAXBSHIFT - EXT2_MINBSHIFT)
+    panic("ext2 filesystem with block size above %d not supported!",
+          EXT2_MAXBSIZE);
+
+  blksize = ext2_blksize(&sb);
+  blkshift = EXT2_MINBSHIFT + sb.sb_log_bsize;
+
+  dx_enabled = sb.sb_features_compat & EXT2F_COMPAT_DIR_INDEX;
+  memcpy(dx_seed, sb.sb_hash_seed, sizeof(dx_seed));
+  dx_unsigned = (sb.sb_flags & EXT2_FLAGS_UNSIGNED_HASH) ? 3 : 0;
+
+  inode_size = sb.sb_inode_size;
+  if (inode_size < sizeof(ext2_inode_t) || inode_size > blksize ||
+      (inode_size & (inode_size - 1)))
+    panic("ext2 filesystem with i-node size %zu not supported!", inode_size);
+
+  if ((error = blk_init(opts->nbufs)))
+    return error;
+
+  if ((error = inode_init(opts->ninodes)))
+    return error;
+
+  aio_sync = opts->flags & EXT2_MNT_SYNCIO;
+
+  if (!(opts->flags & EXT2_MNT_NORA))
+    ra_max = max(opts->ra_max ? opts->ra_max : RA_MAX, RA_MIN);
 
-  if (sb.sb_inode_size != sizeof(ext2_inode_t))
-    panic("The only i-node size supported is %d!", sizeof(ext2_inode_t));
+  if ((error = dcache_init()))
+    return error;
 
     /* Load interesting data from superblock into global variables.
      * Read group descriptor table into memory. */
@@ -573,17 +3615,24 @@ int ext2_mount(const char *fspath) {
   blocks_per_group = sb.sb_bpg;
   block_count = sb.sb_bcount;
 
-  group_desc_count = block_count / blocks_per_group;
-  if (block_count % blocks_per_group != 0) {
-    group_desc_count++;
-  }
   inode_count = sb.sb_icount;
   first_data_block = sb.sb_first_dblock;
 
-  group_desc = malloc(group_desc_count * sizeof(ext2_groupdesc_t));
+  if (!blocks_per_group || !inodes_per_group || block_count <= first_data_block)
+    panic("'%s' has malformed superblock!", fspath);
+
+  /* Groups cover all blocks but those before the first data block. */
+  group_desc_count = howmany(block_count - first_data_block, blocks_per_group);
+
+  if (!(group_desc = malloc(group_desc_count * sizeof(ext2_groupdesc_t))))
+    return ENOMEM;
+
+  /* Group descriptor table starts in the block that follows superblock. */
+  if ((error = ext2_read(0, group_desc, (first_data_block + 1) * blksize,
+                         sizeof(ext2_groupdesc_t) * group_desc_count)))
+    return error;
 
-  return ext2_read(0, group_desc, EXT2_GDOFF,
-                   sizeof(ext2_groupdesc_t) * group_desc_count);
+  return group_init();
 #endif /* !STUDENT */
   return ENOTSUP;
 }
@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include "ext2fs_defs.h"
 
@@ -19,30 +20,137 @@
   })
 #endif
 
+#ifndef max
+#define max(a, b)                                                              \
+  ({                                                                           \
+    __typeof__(a) _a = (a);                                                    \
+    __typeof__(b) _b = (b);                                                    \
+    _a > _b ? _a : _b;                                                         \
+  })
+#endif
+
 #ifndef howmany
 #define howmany(x, y) (((x) + (y)-1) / (y))
 #endif
 
+#ifndef roundup2
+#define roundup2(x, y) (((x) + ((y)-1)) & (~((y)-1)))
+#endif
+
 #ifndef __unused
 #define __unused __attribute__((unused))
 #endif
 
-#define BLKSIZE 1024UL /* size of data stored in the buffer */
+#define BLKSIZE 1024UL /* smallest block size, filesystem may use larger */
+
+/* `whence` values of `ext2_seek`, same as Linux uses for `lseek`. */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3 /* seek to the next data */
+#define SEEK_HOLE 4 /* seek to the next hole */
+#endif
+
+/* Mount flags. */
+#define EXT2_MNT_MMAP 1       /* map whole image into memory instead of pread */
+#define EXT2_MNT_SEQUENTIAL 2 /* image will be mostly read sequentially */
+#define EXT2_MNT_NORA 4       /* do not read ahead of sequential readers */
+#define EXT2_MNT_SYNCIO 8     /* read blocks one by one instead of in batches */
+
+/* Options that alter behaviour of `ext2_mount_opts`. */
+typedef struct ext2_mntopts {
+  unsigned flags; /* any combination of EXT2_MNT_* flags */
+  size_t nbufs;   /* number of block buffers (0 selects default) */
+  size_t ninodes; /* number of cached i-nodes (0 selects default) */
+  size_t ra_max;  /* maximum readahead window in blocks (0 selects default) */
+} ext2_mntopts_t;
+
+/* Cache statistics, so cache size can be tuned for given workload. */
+typedef struct ext2_stats {
+  size_t bc_nbufs;        /* number of block buffers */
+  uint64_t bc_hits;       /* block found in the buffer cache */
+  uint64_t bc_misses;     /* block had to be read from the image */
+  uint64_t bc_ghosthits;  /* missed block was recently evicted */
+  uint64_t bc_evictions;  /* buffer reclaimed to hold another block */
+  uint64_t mc_hits;       /* block address found in translation cache */
+  uint64_t mc_misses;     /* block address had to be read from i-node */
+  uint64_t ic_hits;       /* i-node found in the i-node cache */
+  uint64_t ic_misses;     /* i-node had to be read from i-node table */
+  uint64_t dc_hits;       /* name found in directory entry cache */
+  uint64_t dc_misses;     /* name had to be looked up in directory index */
+  uint64_t dc_indexed;    /* directory index had to be built */
+  uint64_t dc_htree;      /* name was looked up in directory hash tree */
+  uint64_t ra_requests;   /* readahead requests issued to the kernel */
+  uint64_t ra_blocks;     /* blocks requested by readahead */
+  uint64_t ix_hits;       /* i-node or directory found in metadata index */
+  uint64_t aio_batches;   /* batches of reads submitted at once */
+  uint64_t aio_reqs;      /* reads submitted in batches */
+} ext2_stats_t;
 
 /*
  * Extended filesystem 2 types and functions.
  */
 
+/* Directory entry returned by directory iterator. The name is borrowed from
+ * directory block, so it's not NUL-terminated and it's valid only until next
+ * call to `ext2_dir_next` or `ext2_dir_close`. */
+typedef struct ext2_dirview {
+  uint32_t dv_ino;     /* i-node number of entry */
+  uint32_t dv_off;     /* offset of next entry in the directory */
+  uint8_t dv_type;     /* file type */
+  uint8_t dv_namelen;  /* length of string in dv_name */
+  const char *dv_name; /* name (not NUL-terminated!) */
+} ext2_dirview_t;
+
+/* Run of file bytes that are consecutive in the filesystem image. */
+typedef struct ext2_run {
+  off_t r_off;  /* offset in the image (-1 for holes) */
+  size_t r_len; /* length in bytes */
+} ext2_run_t;
+
+/* Open file handle (see `ext2_open`). */
+typedef struct ext2_file ext2_file_t;
+
+/* Directory iterator state. */
+typedef struct ext2_dir {
+  uint32_t di_ino;    /* directory i-node number */
+  uint32_t di_size;   /* directory size in bytes */
+  uint32_t di_off;    /* offset of next entry to examine */
+  uint32_t di_blkidx; /* index of pinned directory block */
+  void *di_blk;       /* pinned directory block (or NULL) */
+} ext2_dir_t;
+
 /* Low-level functions. */
 int ext2_block_used(uint32_t blkaddr);
 int ext2_inode_used(uint32_t ino);
+int ext2_group_used(uint32_t group, uint32_t *blocks_p, uint32_t *inodes_p);
+long ext2_block_find(uint32_t blkaddr, int used);
+long ext2_inode_find(uint32_t ino, int used);
 long ext2_blkaddr_read(uint32_t ino, uint32_t blkidx);
 
 /* High-level functions. */
 int ext2_read(uint32_t ino, void *data, size_t pos, size_t len);
+int ext2_readv(uint32_t ino, const struct iovec *iov, int iovcnt, size_t pos,
+               size_t *countp);
+int ext2_runs(uint32_t ino, size_t pos, size_t len, ext2_run_t *runs,
+              int *nrunsp, size_t *countp);
+int ext2_seek(uint32_t ino, off_t off, int whence, off_t *offp);
+int ext2_image_fd(void);
+int ext2_open(uint32_t ino, ext2_file_t **fp);
+void ext2_close(ext2_file_t *f);
+int ext2_file_readv(ext2_file_t *f, const struct iovec *iov, int iovcnt,
+                    size_t pos, size_t *countp);
+int ext2_file_runs(ext2_file_t *f, size_t pos, size_t len, ext2_run_t *runs,
+                   int *nrunsp, size_t *countp);
+int ext2_file_seek(ext2_file_t *f, off_t off, int whence, off_t *offp);
 int ext2_readdir(uint32_t ino, uint32_t *offp, ext2_dirent_t *de);
+int ext2_dir_open(uint32_t ino, uint32_t off, ext2_dir_t *dir);
+int ext2_dir_next(ext2_dir_t *dir, ext2_dirview_t *dv);
+void ext2_dir_close(ext2_dir_t *dir);
 int ext2_readlink(uint32_t ino, char *buf, size_t buflen);
 int ext2_stat(uint32_t ino, struct stat *st);
 int ext2_lookup(uint32_t ino, const char *name, uint32_t *ino_p,
                 uint8_t *type_p);
 int ext2_mount(const char *imgpath);
+int ext2_mount_opts(const char *imgpath, const ext2_mntopts_t *opts);
+void ext2_stats(ext2_stats_t *st);
+int ext2_index_load(const char *path);
+int ext2_index_save(const char *path);
@@ -13,6 +13,14 @@
 #define EXT2_SBOFF ((off_t)1024)
 #define EXT2_GDOFF ((off_t)2048)
 
+/*
+ * Block size is a power of two between these two values.
+ */
+#define EXT2_MINBSHIFT 10
+#define EXT2_MAXBSHIFT 16
+#define EXT2_MINBSIZE (1 << EXT2_MINBSHIFT)
+#define EXT2_MAXBSIZE (1 << EXT2_MAXBSHIFT)
+
 /*
  * Filesystem identification
  */
@@ -63,8 +71,33 @@ typedef struct ext2_superblock {
   uint8_t sb_prealloc;           /* # of blocks to preallocate */
   uint8_t sb_dir_prealloc;       /* # of blocks to preallocate for dir */
   uint16_t sb_reserved_ngdb;     /* # of reserved gd blocks for resize */
+  uint8_t sb_journal_uuid[16];   /* uuid of journal superblock */
+  uint32_t sb_journal_inum;      /* inode number of journal file */
+  uint32_t sb_journal_dev;       /* device number of journal file */
+  uint32_t sb_last_orphan;       /* start of list of inodes to delete */
+  uint32_t sb_hash_seed[4];      /* HTREE hash seed */
+  uint8_t sb_def_hash_version;   /* default hash version to use */
+  uint8_t sb_jnl_backup_type;    /* journal backup type */
+  uint16_t sb_desc_size;         /* size of group descriptor */
+  uint32_t sb_default_mntopts;   /* default mount options */
+  uint32_t sb_first_meta_bg;     /* first metablock block group */
+  uint32_t sb_mkfs_time;         /* when the filesystem was created */
+  uint32_t sb_jnl_blocks[17];    /* backup of the journal inode */
+  uint32_t sb_bcount_hi;         /* blocks count (high 32 bits) */
+  uint32_t sb_rbcount_hi;        /* reserved blocks count (high 32 bits) */
+  uint32_t sb_fbcount_hi;        /* free blocks count (high 32 bits) */
+  uint16_t sb_min_extra_isize;   /* all inodes have at least # bytes */
+  uint16_t sb_want_extra_isize;  /* new inodes should reserve # bytes */
+  uint32_t sb_flags;             /* miscellaneous flags */
 } ext2_superblock_t;
 
+/* Compatible features. */
+#define EXT2F_COMPAT_DIR_INDEX 0x0020 /* directories may have hash tree */
+
+/* Superblock flags. */
+#define EXT2_FLAGS_SIGNED_HASH 0x0001   /* dir_index hashes signed chars */
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002 /* dir_index hashes unsigned chars */
+
 #define ext2_blksize(sb) (1024UL << (sb)->sb_log_bsize)
 
 /*
@@ -165,6 +198,9 @@ typedef struct ext2_inode {
 _Static_assert(sizeof(ext2_inode_t) == 128,
                "size of ext2 i-node must be 128 bytes");
 
+/* I-node status flags. */
+#define EXT2_INDEX_FL 0x00001000 /* directory has hash tree index */
+
 /* File permissions. */
 #define EXT2_IEXEC 0000100  /* Executable. */
 #define EXT2_IWRITE 0000200 /* Writable. */
@@ -224,3 +260,43 @@ typedef struct ext2_dirent {
   uint8_t de_type;                  /* file type */
   char de_name[EXT2_MAXNAMLEN + 1]; /* name with length <= EXT2_MAXNAMLEN */
 } ext2_dirent_t;
+
+/*
+ * Directories with EXT2_INDEX_FL flag have a hash tree (htree) of directory
+ * blocks. Its root is kept in the first block after "." and ".." entries,
+ * whose record lengths cover the whole block, so the index is invisible to
+ * code that does not know about it. Internal nodes are directory blocks with
+ * single empty entry spanning the whole block. Each node holds entries that
+ * map lowest hash value of names kept in subtree to its first block. First
+ * entry has no hash value, its place is taken by limit and count of entries.
+ */
+
+/* Hash functions of names. Unsigned variants are never stored on disk. */
+enum {
+  EXT2_DX_HASH_LEGACY = 0,
+  EXT2_DX_HASH_HALF_MD4 = 1,
+  EXT2_DX_HASH_TEA = 2,
+  EXT2_DX_HASH_LEGACY_UNSIGNED = 3,
+  EXT2_DX_HASH_HALF_MD4_UNSIGNED = 4,
+  EXT2_DX_HASH_TEA_UNSIGNED = 5,
+};
+
+#define EXT2_DX_ROOT_OFF 24 /* offset of `ext2_dxroot_t` in the first block */
+#define EXT2_DX_NODE_OFF 8  /* offset of entries in internal node blocks */
+#define EXT2_DX_MAXLEVELS 3 /* root and at most two levels of nodes */
+
+typedef struct ext2_dxroot {
+  uint32_t dr_zero;         /* always zero */
+  uint8_t dr_hash_version;  /* hash function of names */
+  uint8_t dr_info_length;   /* size of this structure, i.e. 8 */
+  uint8_t dr_levels;        /* number of levels of internal nodes */
+  uint8_t dr_flags;         /* unused */
+} ext2_dxroot_t;
+
+typedef struct ext2_dxentry {
+  uint32_t dx_hash;  /* lowest hash value in the subtree (limit and count) */
+  uint32_t dx_block; /* directory block index */
+} ext2_dxentry_t;
+
+#define dx_limit(ents) ((uint16_t *)(ents))[0]
+#define dx_count(ents) ((uint16_t *)(ents))[1]
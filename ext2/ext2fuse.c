@@ -4,6 +4,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse_lowlevel.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,8 +13,31 @@
 
 #include "ext2fs.h"
 
+/* The lseek operation was added in libfuse 3.8. */
+#if FUSE_VERSION < FUSE_MAKE_VERSION(3, 8)
+#error "libfuse 3.8 or newer is required"
+#endif
+
 typedef struct fuse_file_info fuse_file_info_t;
 
+/* Maximum number of pieces of a read reply that is spliced from the image.
+ * Replies that are more fragmented are copied into a temporary buffer. */
+#define RUNS_MAX_READ 64
+
+/* Holes up to this size are sent from a shared buffer of zeros. */
+#define ZEROS_SIZE (1UL << 17)
+
+static char zeros[ZEROS_SIZE];
+
+/* libfuse 3 does not splice replies unless asked to, so without this file
+ * descriptor backed buffers of `e2fs_read` would be copied anyway. */
+static void e2fs_init(void *userdata __unused, struct fuse_conn_info *conn) {
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
 static void e2fs_getattr(fuse_req_t req, fuse_ino_t ino,
                          fuse_file_info_t *fi __unused) {
   struct stat st;
@@ -56,31 +81,135 @@ static void e2fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
   fuse_reply_entry(req, &e);
 }
 
-static void e2fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-                         off_t _off, fuse_file_info_t *fi __unused) {
+/* Conversion of directory entry file types to file mode types. */
+static const mode_t ext2_ft_mode[] = {
+  [EXT2_FT_UNKNOWN] = 0,       [EXT2_FT_REG] = S_IFREG,
+  [EXT2_FT_DIR] = S_IFDIR,     [EXT2_FT_CHRDEV] = S_IFCHR,
+  [EXT2_FT_BLKDEV] = S_IFBLK,  [EXT2_FT_FIFO] = S_IFIFO,
+  [EXT2_FT_SOCK] = S_IFSOCK,   [EXT2_FT_SYMLINK] = S_IFLNK,
+};
+
+/* State of an open directory. Reply buffer is kept between requests, so
+ * listing a directory does not call malloc for each batch of entries. */
+typedef struct e2fs_dir {
+  char *buf;      /* reply buffer */
+  size_t bufsize; /* size of reply buffer */
+} e2fs_dir_t;
+
+static void e2fs_opendir(fuse_req_t req, fuse_ino_t ino,
+                         fuse_file_info_t *fi) {
+  struct stat st;
   int error;
 
   if (ino == 1)
     ino = EXT2_ROOTINO;
 
-  ext2_dirent_t de;
-  uint32_t off = _off;
-  if (!ext2_readdir(ino, &off, &de)) {
-    fuse_reply_buf(req, NULL, 0);
+  if ((error = ext2_stat(ino, &st))) {
+    fuse_reply_err(req, error);
     return;
   }
 
-  void *buf = malloc(size);
-  assert(buf != NULL);
-  struct stat st;
-  if ((error = ext2_stat(de.de_ino, &st))) {
+  if (!S_ISDIR(st.st_mode)) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  e2fs_dir_t *d = calloc(1, sizeof(e2fs_dir_t));
+  if (d == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  fi->fh = (uintptr_t)d;
+  fuse_reply_open(req, fi);
+}
+
+static void e2fs_releasedir(fuse_req_t req, fuse_ino_t ino __unused,
+                            fuse_file_info_t *fi) {
+  e2fs_dir_t *d = (e2fs_dir_t *)(uintptr_t)fi->fh;
+  free(d->buf);
+  free(d);
+  fuse_reply_err(req, 0);
+}
+
+/* Fills reply buffer with as many directory entries as fit into `size` bytes.
+ * If `plus` is set, then attributes of each entry are returned as well. */
+static void e2fs_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, fuse_file_info_t *fi, bool plus) {
+  e2fs_dir_t *d = (e2fs_dir_t *)(uintptr_t)fi->fh;
+  int error;
+
+  if (ino == 1)
+    ino = EXT2_ROOTINO;
+
+  if (d->bufsize < size) {
+    char *buf = realloc(d->buf, size);
+    if (buf == NULL) {
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+    d->buf = buf;
+    d->bufsize = size;
+  }
+
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+  if ((error = ext2_dir_open(ino, off, &dir))) {
     fuse_reply_err(req, error);
     return;
   }
-  size = fuse_add_direntry(req, buf, size, de.de_name, &st, off);
-  error = fuse_reply_buf(req, buf, size);
+
+  size_t used = 0;
+  while (ext2_dir_next(&dir, &dv)) {
+    char name[EXT2_MAXNAMLEN + 1];
+    memcpy(name, dv.dv_name, dv.dv_namelen);
+    name[dv.dv_namelen] = '\0';
+
+    size_t entsize;
+    if (plus) {
+      struct fuse_entry_param e;
+      memset(&e, 0, sizeof(e));
+      /* Entries are never left out. The error is reported by this request
+       * if nothing was added yet, otherwise by the next one. */
+      if ((error = ext2_stat(dv.dv_ino, &e.attr))) {
+        if (used > 0)
+          break;
+        ext2_dir_close(&dir);
+        fuse_reply_err(req, error);
+        return;
+      }
+      e.ino = dv.dv_ino;
+      e.attr_timeout = 1.0;
+      e.entry_timeout = 1.0;
+      entsize = fuse_add_direntry_plus(req, d->buf + used, size - used, name,
+                                       &e, dv.dv_off);
+    } else {
+      /* Only i-node number and file type are used by the kernel. */
+      struct stat st = {.st_ino = dv.dv_ino,
+                        .st_mode = ext2_ft_mode[dv.dv_type & 7]};
+      entsize = fuse_add_direntry(req, d->buf + used, size - used, name, &st,
+                                  dv.dv_off);
+    }
+
+    /* The entry that did not fit will be returned by next request. */
+    if (entsize > size - used)
+      break;
+    used += entsize;
+  }
+
+  ext2_dir_close(&dir);
+  error = fuse_reply_buf(req, d->buf, used);
   assert(error == 0);
-  free(buf);
+}
+
+static void e2fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, fuse_file_info_t *fi) {
+  e2fs_do_readdir(req, ino, size, off, fi, false);
+}
+
+static void e2fs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t off, fuse_file_info_t *fi) {
+  e2fs_do_readdir(req, ino, size, off, fi, true);
 }
 
 static void e2fs_readlink(fuse_req_t req, fuse_ino_t ino) {
@@ -127,37 +256,89 @@ static void e2fs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info_t *fi) {
     return;
   }
 
-  fuse_reply_open(req, fi);
+  /* I-node and block map are looked up once, reads use the handle only. */
+  ext2_file_t *f;
+  if ((error = ext2_open(ino, &f))) {
+    fuse_reply_err(req, error);
+    return;
+  }
+
+  fi->fh = (uintptr_t)f;
+  if (fuse_reply_open(req, fi))
+    ext2_close(f);
 }
 
-static void e2fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                      fuse_file_info_t *fi __unused) {
-  int error;
+static void e2fs_release(fuse_req_t req, fuse_ino_t ino __unused,
+                         fuse_file_info_t *fi) {
+  ext2_close((ext2_file_t *)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+}
 
-  if (ino == 1)
-    ino = EXT2_ROOTINO;
+static void e2fs_read(fuse_req_t req, fuse_ino_t ino __unused, size_t size,
+                      off_t off, fuse_file_info_t *fi) {
+  ext2_file_t *f = (ext2_file_t *)(uintptr_t)fi->fh;
+  int error;
 
-  struct stat st;
-  if ((error = ext2_stat(ino, &st))) {
-    fuse_reply_err(req, error);
-    return;
-  }
+  /* Data runs are passed as file descriptor backed buffers, so libfuse can
+   * splice them from the image to the kernel without copying them to user
+   * space. Holes are sent from memory. */
+  ext2_run_t runs[RUNS_MAX_READ];
+  int nruns = RUNS_MAX_READ;
+  size_t count;
+  error = ext2_file_runs(f, off, size, runs, &nruns, &count);
+  /* Less than `size` bytes are described at the end of file too. */
+  if (!error && (count == size || nruns < RUNS_MAX_READ)) {
+    struct {
+      struct fuse_bufvec bv;
+      struct fuse_buf more[RUNS_MAX_READ - 1];
+    } reply = {.bv = FUSE_BUFVEC_INIT(0)};
+    struct fuse_buf *fb = reply.bv.buf;
+    bool ok = true;
+
+    reply.bv.count = nruns;
+    for (int i = 0; i < nruns; i++) {
+      if (runs[i].r_off < 0) {
+        ok &= runs[i].r_len <= ZEROS_SIZE;
+        fb[i] = (struct fuse_buf){.size = runs[i].r_len, .mem = zeros};
+      } else {
+        fb[i] = (struct fuse_buf){.size = runs[i].r_len,
+                                  .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                                  .fd = ext2_image_fd(),
+                                  .pos = runs[i].r_off};
+      }
+    }
 
-  if (!S_ISREG(st.st_mode) || (off > st.st_size)) {
-    fuse_reply_err(req, EINVAL);
-    return;
+    if (ok) {
+      error = fuse_reply_data(req, &reply.bv, 0);
+      assert(error == 0);
+      return;
+    }
   }
 
-  size = min(size, (size_t)(st.st_size - off));
-
   void *buf = malloc(size);
   assert(buf != NULL);
-  ext2_read(ino, buf, off, size);
-  error = fuse_reply_buf(req, buf, size);
+  struct iovec iov = {.iov_base = buf, .iov_len = size};
+  if ((error = ext2_file_readv(f, &iov, 1, off, &count)))
+    error = fuse_reply_err(req, error);
+  else
+    error = fuse_reply_buf(req, buf, count);
   assert(error == 0);
   free(buf);
 }
 
+/* Kernel forwards only SEEK_DATA and SEEK_HOLE here, so tools that copy sparse
+ * files (e.g. `cp`) skip the holes instead of reading zeros. */
+static void e2fs_lseek(fuse_req_t req, fuse_ino_t ino __unused, off_t off,
+                       int whence, fuse_file_info_t *fi) {
+  ext2_file_t *f = (ext2_file_t *)(uintptr_t)fi->fh;
+  int error;
+
+  if ((error = ext2_file_seek(f, off, whence, &off)))
+    fuse_reply_err(req, error);
+  else
+    fuse_reply_lseek(req, off);
+}
+
 static void e2fs_statfs(fuse_req_t req, fuse_ino_t ino __unused) {
   struct statvfs statfs;
   memset(&statfs, 0, sizeof(statfs));
@@ -165,40 +346,56 @@ static void e2fs_statfs(fuse_req_t req, fuse_ino_t ino __unused) {
 }
 
 static struct fuse_lowlevel_ops e2fs_oper = {
+  .init = e2fs_init,
   .lookup = e2fs_lookup,
   .getattr = e2fs_getattr,
+  .opendir = e2fs_opendir,
   .readdir = e2fs_readdir,
+  .readdirplus = e2fs_readdirplus,
+  .releasedir = e2fs_releasedir,
   .readlink = e2fs_readlink,
   .open = e2fs_open,
   .read = e2fs_read,
+  .release = e2fs_release,
+  .lseek = e2fs_lseek,
   .statfs = e2fs_statfs,
 };
 
 int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-  struct fuse_chan *ch;
+  struct fuse_cmdline_opts opts;
   struct fuse_session *se;
-  char *mountpoint;
-  int multithreaded, foreground, err = -1;
+  int err = -1;
 
   if ((err = ext2_mount("debian9-ext2.img"))) {
     fprintf(stderr, "Cannot open 'debian9-ext2.img': %s!\n", strerror(err));
     return EXIT_FAILURE;
   }
 
-  if (!fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) &&
-      (ch = fuse_mount(mountpoint, &args))) {
-    if ((se = fuse_lowlevel_new(&args, &e2fs_oper, sizeof(e2fs_oper), NULL))) {
-      if (fuse_set_signal_handlers(se) != -1) {
-        fuse_session_add_chan(se, ch);
-        err = fuse_session_loop(se);
-        fuse_remove_signal_handlers(se);
-        fuse_session_remove_chan(ch);
+  /* Metadata index is optional, e.g. built with `ext2list -x`. */
+  ext2_index_load("debian9-ext2.idx");
+
+  if (fuse_parse_cmdline(&args, &opts))
+    return EXIT_FAILURE;
+
+  if (opts.show_help || opts.mountpoint == NULL) {
+    printf("Usage: %s [options] <mountpoint>\n\n", argv[0]);
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    err = opts.show_help ? 0 : -1;
+  } else if ((se = fuse_session_new(&args, &e2fs_oper, sizeof(e2fs_oper),
+                                    NULL))) {
+    if (fuse_set_signal_handlers(se) != -1) {
+      if (fuse_session_mount(se, opts.mountpoint) == 0) {
+        err = opts.singlethread ? fuse_session_loop(se)
+                                : fuse_session_loop_mt(se, opts.clone_fd);
+        fuse_session_unmount(se);
       }
-      fuse_session_destroy(se);
+      fuse_remove_signal_handlers(se);
     }
-    fuse_unmount(mountpoint, ch);
+    fuse_session_destroy(se);
   }
+  free(opts.mountpoint);
   fuse_opt_free_args(&args);
 
   return err ? 1 : 0;
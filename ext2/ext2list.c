@@ -1,43 +1,61 @@
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdnoreturn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 
-#include "md5.h"
+#include "hash.h"
 #include "ext2fs.h"
 
-static void showfile(const char *path, uint32_t ino) {
+/* Size of buffer that regular files are read into to be hashed. */
+#define READBUF_SIZE (1024 * BLKSIZE)
+
+/* Limits of numeric options: buffers in the cache and worker threads. */
+#define MAX_NBUFS (1L << 24)
+#define MAX_THREADS 256L
+
+/* How many entries can be listed ahead of the one being printed. Workers wait
+ * for the printer to catch up if there are more. */
+#define MAX_PENDING 65536
+
+static const hash_engine_t *hasher = &hash_md5; /* content hash engine */
+
+static void showfile(FILE *out, const char *path, uint32_t ino,
+                     uint8_t *data) {
   struct stat sb[1];
 
   memset(sb, 0, sizeof(struct stat));
   ext2_stat(ino, sb);
 
-  printf("path=%s ino=%ld mode=%o nlink=%ld uid=%d gid=%d "
-         "size=%ld atime=%ld mtime=%ld ctime=%ld",
-         path, sb->st_ino, sb->st_mode, sb->st_nlink, sb->st_uid, sb->st_gid,
-         sb->st_size, sb->st_atime, sb->st_mtime, sb->st_ctime);
+  fprintf(out,
+          "path=%s ino=%ld mode=%o nlink=%ld uid=%d gid=%d "
+          "size=%ld atime=%ld mtime=%ld ctime=%ld",
+          path, sb->st_ino, sb->st_mode, sb->st_nlink, sb->st_uid, sb->st_gid,
+          sb->st_size, sb->st_atime, sb->st_mtime, sb->st_ctime);
 
   switch (sb->st_mode & S_IFMT) {
     case S_IFREG: {
-      uint8_t data[BLKSIZE];
       size_t pos = 0;
       size_t len = sb->st_size;
-      MD5_CTX ctx;
+      hash_ctx_t ctx;
 
-      MD5Init(&ctx);
+      hash_init(&ctx, hasher);
 
       while (len > 0) {
-        size_t cnt = min(len, BLKSIZE);
+        size_t cnt = min(len, READBUF_SIZE);
         if (ext2_read(ino, data, pos, cnt))
           break;
-        MD5Update(&ctx, data, cnt);
+        hash_update(&ctx, data, cnt);
         len -= cnt;
         pos += cnt;
       }
 
-      char md5sum[MD5_DIGEST_STRING_LENGTH];
-      MD5End(&ctx, md5sum);
-      printf(" md5=%s", md5sum);
+      char digest[HASH_STRING_MAX];
+      hash_end(&ctx, digest);
+      fprintf(out, " %s=%s", hasher->he_name, digest);
       break;
     }
     case S_IFLNK: {
@@ -47,46 +65,312 @@ static void showfile(const char *path, uint32_t ino) {
       } else {
         symlink[sb->st_size] = '\0';
       }
-      printf(" target=%s", symlink);
+      fprintf(out, " target=%s", symlink);
       break;
     }
     default:
       break;
   }
-  putchar('\n');
+  fputc('\n', out);
 }
 
-static void listdir(const char *path, uint32_t ino) {
-  char newpath[strlen(path) + EXT2_MAXNAMLEN + 2];
+/*
+ * Parallel tree walker.
+ *
+ * Every directory entry becomes a node of a tree that mirrors the filesystem.
+ * Visiting a node formats its line (which for regular files means reading
+ * whole contents) and, for directories, creates child nodes in the order they
+ * appear in the directory. Visits are done by a pool of workers, each with its
+ * own deque of nodes: the owner takes the most recently pushed node, idle
+ * workers steal the oldest one from others, i.e. the biggest subtree.
+ *
+ * The main thread prints nodes in pre-order, so output is the same as that of
+ * a single-threaded recursive walk. If the node to be printed has not been
+ * visited yet, the printer visits it by itself. Thus it never waits for a
+ * worker that waits for the printer to catch up.
+ */
 
-  ext2_dirent_t de;
-  uint32_t off = 0;
-  while (ext2_readdir(ino, &off, &de)) {
-    if (strncmp(de.de_name, ".", de.de_namelen) == 0)
-      continue;
-    if (strncmp(de.de_name, "..", de.de_namelen) == 0)
+typedef enum { NODE_QUEUED, NODE_BUSY, NODE_DONE } node_state_t;
+
+typedef struct node {
+  node_state_t n_state;       /* protected by `wlock` */
+  unsigned n_refcnt;          /* tree and deque references (atomic) */
+  uint32_t n_ino;             /* i-node number */
+  uint8_t n_type;             /* file type from directory entry */
+  char *n_line;               /* formatted output line (if done) */
+  size_t n_linelen;           /* length of `n_line` */
+  struct node **n_children;   /* child nodes (if a directory) */
+  size_t n_nchildren;         /* number of child nodes */
+  char n_path[];              /* path of the file */
+} node_t;
+
+typedef struct worker {
+  pthread_mutex_t w_lock; /* protects the deque */
+  node_t **w_deque;       /* nodes to visit */
+  size_t w_head;          /* oldest node, taken by thieves */
+  size_t w_tail;          /* one past newest node, taken by the owner */
+  size_t w_size;          /* capacity of `w_deque` */
+  uint8_t *w_buf;         /* buffer for file contents */
+  pthread_t w_thread;
+} worker_t;
+
+static worker_t *workers; /* slot 0 belongs to the printer */
+static size_t nworkers;   /* including the printer */
+
+static pthread_mutex_t wlock; /* protects all below and node states */
+static pthread_cond_t wcv;    /* signalled when there is work or a node done */
+static size_t nidle;          /* workers waiting for work */
+static size_t npending;       /* nodes created, but not printed yet */
+static bool finished;         /* all nodes were printed */
+
+static node_t *node_alloc(const char *path, size_t pathlen, uint32_t ino,
+                          uint8_t type) {
+  node_t *n = malloc(sizeof(node_t) + pathlen + 1);
+  if (!n) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  *n = (node_t){.n_state = NODE_QUEUED, .n_refcnt = 2, .n_ino = ino,
+                .n_type = type};
+  memcpy(n->n_path, path, pathlen);
+  n->n_path[pathlen] = '\0';
+  return n;
+}
+
+static void node_release(node_t *n) {
+  if (__atomic_sub_fetch(&n->n_refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  free(n->n_line);
+  free(n->n_children);
+  free(n);
+}
+
+/* Pushes `n` nodes from `nodes` in reverse, so that the owner pops them in
+ * the original order. */
+static void deque_push(worker_t *w, node_t **nodes, size_t n) {
+  pthread_mutex_lock(&w->w_lock);
+  if (w->w_head == w->w_tail)
+    w->w_head = w->w_tail = 0;
+  if (w->w_tail + n > w->w_size) {
+    size_t used = w->w_tail - w->w_head;
+    memmove(w->w_deque, w->w_deque + w->w_head, used * sizeof(node_t *));
+    w->w_head = 0;
+    w->w_tail = used;
+    if (used + n > w->w_size) {
+      w->w_size = max(used + n, 2 * w->w_size);
+      w->w_deque = realloc(w->w_deque, w->w_size * sizeof(node_t *));
+      if (!w->w_deque) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  for (size_t i = n; i > 0; i--)
+    w->w_deque[w->w_tail++] = nodes[i - 1];
+  pthread_mutex_unlock(&w->w_lock);
+
+  pthread_mutex_lock(&wlock);
+  if (nidle > 0)
+    pthread_cond_broadcast(&wcv);
+  pthread_mutex_unlock(&wlock);
+}
+
+static node_t *deque_pop(worker_t *w, bool steal) {
+  node_t *n = NULL;
+  pthread_mutex_lock(&w->w_lock);
+  if (w->w_head < w->w_tail)
+    n = steal ? w->w_deque[w->w_head++] : w->w_deque[--w->w_tail];
+  pthread_mutex_unlock(&w->w_lock);
+  return n;
+}
+
+/* Takes a node from own deque or steals one from another worker. */
+static node_t *worker_take(worker_t *self) {
+  node_t *n = deque_pop(self, false);
+  size_t me = self - workers;
+  for (size_t i = 1; !n && i < nworkers; i++)
+    n = deque_pop(&workers[(me + i) % nworkers], true);
+  return n;
+}
+
+/* Formats line of node `n` and lists its children if it is a directory. The
+ * node must be claimed, i.e. in NODE_BUSY state. */
+static void node_visit(worker_t *self, node_t *n) {
+  FILE *out = open_memstream(&n->n_line, &n->n_linelen);
+  if (!out) {
+    perror("open_memstream");
+    exit(EXIT_FAILURE);
+  }
+  showfile(out, n->n_path, n->n_ino, self->w_buf);
+  fclose(out);
+
+  size_t pathlen = strlen(n->n_path);
+  char newpath[pathlen + EXT2_MAXNAMLEN + 2];
+  size_t size = 0;
+
+  ext2_dirview_t dv;
+  ext2_dir_t dir;
+  if (n->n_type == EXT2_FT_DIR && !ext2_dir_open(n->n_ino, 0, &dir)) {
+    while (ext2_dir_next(&dir, &dv)) {
+      if (dv.dv_namelen == 1 && dv.dv_name[0] == '.')
+        continue;
+      if (dv.dv_namelen == 2 && dv.dv_name[0] == '.' && dv.dv_name[1] == '.')
+        continue;
+
+      memcpy(newpath, n->n_path, pathlen);
+      newpath[pathlen] = '/';
+      memcpy(newpath + pathlen + 1, dv.dv_name, dv.dv_namelen);
+
+      if (n->n_nchildren == size) {
+        size = max(2 * size, 16UL);
+        n->n_children = realloc(n->n_children, size * sizeof(node_t *));
+        if (!n->n_children) {
+          perror("realloc");
+          exit(EXIT_FAILURE);
+        }
+      }
+      n->n_children[n->n_nchildren++] = node_alloc(
+        newpath, pathlen + 1 + dv.dv_namelen, dv.dv_ino, dv.dv_type);
+    }
+    ext2_dir_close(&dir);
+  }
+
+  if (n->n_nchildren > 0) {
+    __atomic_add_fetch(&npending, n->n_nchildren, __ATOMIC_RELAXED);
+    deque_push(self, n->n_children, n->n_nchildren);
+  }
+
+  pthread_mutex_lock(&wlock);
+  n->n_state = NODE_DONE;
+  pthread_cond_broadcast(&wcv);
+  pthread_mutex_unlock(&wlock);
+}
+
+/* Visits node `n` unless it was claimed by another thread already. */
+static void node_claim(worker_t *self, node_t *n) {
+  pthread_mutex_lock(&wlock);
+  bool mine = n->n_state == NODE_QUEUED;
+  if (mine)
+    n->n_state = NODE_BUSY;
+  pthread_mutex_unlock(&wlock);
+
+  if (mine)
+    node_visit(self, n);
+}
+
+static void *worker_main(void *arg) {
+  worker_t *self = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&wlock);
+    while (!finished &&
+           __atomic_load_n(&npending, __ATOMIC_RELAXED) > MAX_PENDING) {
+      nidle++;
+      pthread_cond_wait(&wcv, &wlock);
+      nidle--;
+    }
+    pthread_mutex_unlock(&wlock);
+
+    node_t *n = worker_take(self);
+
+    if (n) {
+      node_claim(self, n);
+      node_release(n);
       continue;
+    }
 
-    strcpy(newpath, path);
-    strcat(newpath, "/");
-    strcat(newpath, de.de_name);
+    /* Deques must be checked again after becoming idle, since a node pushed
+     * in between would not wake us up. */
+    pthread_mutex_lock(&wlock);
+    nidle++;
+    while (!finished && !(n = worker_take(self)))
+      pthread_cond_wait(&wcv, &wlock);
+    nidle--;
+    pthread_mutex_unlock(&wlock);
 
-    showfile(newpath, de.de_ino);
+    if (!n)
+      return NULL;
+    node_claim(self, n);
+    node_release(n);
+  }
+}
+
+/* Prints subtree rooted at `n` in pre-order and releases it. */
+static void node_print(worker_t *self, node_t *n) {
+  node_claim(self, n);
+
+  pthread_mutex_lock(&wlock);
+  while (n->n_state != NODE_DONE)
+    pthread_cond_wait(&wcv, &wlock);
+  pthread_mutex_unlock(&wlock);
+
+  fwrite(n->n_line, 1, n->n_linelen, stdout);
+
+  for (size_t i = 0; i < n->n_nchildren; i++) {
+    node_print(self, n->n_children[i]);
+
+    /* Let throttled workers proceed once printer made some progress. */
+    if (__atomic_sub_fetch(&npending, 1, __ATOMIC_RELAXED) == MAX_PENDING / 2) {
+      pthread_mutex_lock(&wlock);
+      pthread_cond_broadcast(&wcv);
+      pthread_mutex_unlock(&wlock);
+    }
+  }
+
+  node_release(n);
+}
+
+static void listall(size_t nthreads) {
+  nworkers = nthreads + 1;
+  if (!(workers = calloc(nworkers, sizeof(worker_t)))) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&wlock, NULL);
+  pthread_cond_init(&wcv, NULL);
+
+  for (size_t i = 0; i < nworkers; i++) {
+    worker_t *w = &workers[i];
+    pthread_mutex_init(&w->w_lock, NULL);
+    if (!(w->w_buf = malloc(READBUF_SIZE))) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  node_t *root = node_alloc(".", 1, EXT2_ROOTINO, EXT2_FT_DIR);
+  deque_push(&workers[0], &root, 1);
 
-    if (de.de_type == EXT2_FT_DIR)
-      listdir(newpath, de.de_ino);
+  for (size_t i = 1; i < nworkers; i++)
+    pthread_create(&workers[i].w_thread, NULL, worker_main, &workers[i]);
+
+  node_print(&workers[0], root);
+
+  pthread_mutex_lock(&wlock);
+  finished = true;
+  pthread_cond_broadcast(&wcv);
+  pthread_mutex_unlock(&wlock);
+
+  for (size_t i = 1; i < nworkers; i++)
+    pthread_join(workers[i].w_thread, NULL);
+
+  /* Drop stale references to nodes that were visited by someone else. */
+  for (size_t i = 0; i < nworkers; i++) {
+    for (node_t *n; (n = deque_pop(&workers[i], false));)
+      node_release(n);
+    free(workers[i].w_deque);
+    free(workers[i].w_buf);
   }
+  free(workers);
 }
 
 static void count_used_inodes(void) {
   unsigned used = 0;
 
-  for (uint32_t ino = 1;; ino++) {
-    int res = ext2_inode_used(ino);
-    if (res == EINVAL)
-      break;
-    used += res;
-  }
+  uint32_t count;
+  for (uint32_t group = 0; !ext2_group_used(group, NULL, &count); group++)
+    used += count;
 
   fprintf(stderr, "used inodes: %u\n", used);
 }
@@ -94,23 +378,133 @@ static void count_used_inodes(void) {
 static void count_used_blocks(void) {
   unsigned used = 0;
 
-  for (uint32_t blk = 1;; blk++) {
-    int res = ext2_block_used(blk);
-    if (res == EINVAL)
-      break;
-    used += res;
-  }
+  uint32_t count;
+  for (uint32_t group = 0; !ext2_group_used(group, &count, NULL); group++)
+    used += count;
 
   fprintf(stderr, "used blocks: %u\n", used);
 }
 
-int main(void) {
-  if (ext2_mount("debian9-ext2.img"))
+static void print_stats(void) {
+  ext2_stats_t st;
+
+  ext2_stats(&st);
+
+  uint64_t lookups = st.bc_hits + st.bc_misses;
+  fprintf(stderr,
+          "buffer cache: %zu buffers, %lu hits, %lu misses "
+          "(%lu ghost hits), %lu evictions, %.2f%% hit rate\n",
+          st.bc_nbufs, st.bc_hits, st.bc_misses, st.bc_ghosthits,
+          st.bc_evictions, lookups ? 100.0 * st.bc_hits / lookups : 0.0);
+
+  lookups = st.mc_hits + st.mc_misses;
+  fprintf(stderr,
+          "block map cache: %lu hits, %lu misses, %.2f%% hit rate\n",
+          st.mc_hits, st.mc_misses,
+          lookups ? 100.0 * st.mc_hits / lookups : 0.0);
+
+  lookups = st.ic_hits + st.ic_misses;
+  fprintf(stderr, "i-node cache: %lu hits, %lu misses, %.2f%% hit rate\n",
+          st.ic_hits, st.ic_misses,
+          lookups ? 100.0 * st.ic_hits / lookups : 0.0);
+
+  lookups = st.dc_hits + st.dc_misses;
+  fprintf(stderr,
+          "dentry cache: %lu hits, %lu misses, %lu directories indexed, "
+          "%lu hash tree lookups, %.2f%% hit rate\n",
+          st.dc_hits, st.dc_misses, st.dc_indexed, st.dc_htree,
+          lookups ? 100.0 * st.dc_hits / lookups : 0.0);
+
+  fprintf(stderr, "readahead: %lu requests, %lu blocks\n", st.ra_requests,
+          st.ra_blocks);
+
+  fprintf(stderr, "metadata index: %lu hits\n", st.ix_hits);
+
+  fprintf(stderr, "batched reads: %lu batches, %lu reads\n", st.aio_batches,
+          st.aio_reqs);
+}
+
+static noreturn void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-m] [-S] [-s] [-c nbufs] [-j nthreads] [-a hash] "
+          "[-x index]\n",
+          prog);
+  fprintf(stderr, "  -m  map the filesystem image into memory\n");
+  fprintf(stderr, "  -S  read blocks one by one instead of in batches\n");
+  fprintf(stderr, "  -s  print cache statistics when done\n");
+  fprintf(stderr, "  -c  number of block buffers to use\n");
+  fprintf(stderr, "  -j  number of worker threads (default: one per CPU)\n");
+  fprintf(stderr, "  -a  content hash: md5 (default), xxh64 or blake3\n");
+  fprintf(stderr, "  -x  use metadata index file, (re)build it if stale\n");
+  exit(EXIT_FAILURE);
+}
+
+/* Parses `arg` of an option as a decimal number from `lo` to `hi`. */
+static long parse_number(const char *prog, const char *arg, long lo,
+                         long hi) {
+  char *end;
+  errno = 0;
+  long val = strtol(arg, &end, 10);
+  if (errno || end == arg || *end != '\0' || val < lo || val > hi) {
+    fprintf(stderr, "%s: '%s' is not a number from %ld to %ld\n", prog, arg,
+            lo, hi);
+    usage(prog);
+  }
+  return val;
+}
+
+int main(int argc, char *argv[]) {
+  ext2_mntopts_t opts = {.flags = 0, .nbufs = 0, .ninodes = 0};
+  bool show_stats = false;
+  const char *index = NULL;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int ch;
+
+  while ((ch = getopt(argc, argv, "mSsc:j:a:x:")) != -1) {
+    switch (ch) {
+      case 'm':
+        opts.flags |= EXT2_MNT_MMAP | EXT2_MNT_SEQUENTIAL;
+        break;
+      case 'S':
+        opts.flags |= EXT2_MNT_SYNCIO;
+        break;
+      case 's':
+        show_stats = true;
+        break;
+      case 'c':
+        opts.nbufs = parse_number(argv[0], optarg, 0, MAX_NBUFS);
+        break;
+      case 'j':
+        nthreads = parse_number(argv[0], optarg, 1, MAX_THREADS);
+        break;
+      case 'a':
+        if (!(hasher = hash_lookup(optarg)))
+          usage(argv[0]);
+        break;
+      case 'x':
+        index = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (ext2_mount_opts("debian9-ext2.img", &opts))
     exit(EXIT_FAILURE);
 
-  showfile(".", EXT2_ROOTINO);
-  listdir(".", EXT2_ROOTINO);
+  /* Missing or stale index is built once the tree has been listed, so it
+   * can be made of metadata that is in the caches already. */
+  bool save_index = index != NULL && ext2_index_load(index) != 0;
+
+  listall(min(max(nthreads, 1L), MAX_THREADS));
+
+  int error;
+  if (save_index && (error = ext2_index_save(index)))
+    fprintf(stderr, "%s: %s\n", index, strerror(error));
+
   count_used_blocks();
   count_used_inodes();
+  if (show_stats)
+    print_stats();
   exit(EXIT_SUCCESS);
 }
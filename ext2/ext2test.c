@@ -1,9 +1,11 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -119,7 +121,8 @@ static int do_read(char *arg) {
     return error;
 
   struct stat st;
-  ext2_stat(ino, &st);
+  if ((error = ext2_stat(ino, &st)))
+    return error;
 
   if (!(st.st_mode & S_IFREG))
     return EINVAL;
@@ -139,6 +142,77 @@ static int do_read(char *arg) {
   return 0;
 }
 
+/* Size of buffer used to copy file data out of the filesystem. */
+#define COPYBUF_SIZE (256 * BLKSIZE)
+
+/* Copy regular file out of the filesystem. Only data regions are read and
+ * written, so holes of sparse files stay holes in the copy. */
+static int do_get(char *arg) {
+  char *name = strsep(&arg, " ");
+  uint32_t ino;
+  int error;
+
+  if (name == NULL || arg == NULL)
+    return EINVAL;
+
+  if ((error = ext2_lookup(curdir, name, &ino, NULL)))
+    return error;
+
+  struct stat st;
+  if ((error = ext2_stat(ino, &st)))
+    return error;
+
+  if (!S_ISREG(st.st_mode))
+    return EINVAL;
+
+  ext2_file_t *f;
+  if ((error = ext2_open(ino, &f)))
+    return error;
+
+  int fd = open(arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ext2_close(f);
+    return errno;
+  }
+
+  static uint8_t data[COPYBUF_SIZE];
+  off_t pos = 0, end;
+  size_t copied = 0;
+
+  if (ftruncate(fd, st.st_size))
+    error = errno;
+
+  while (!error && !(error = ext2_file_seek(f, pos, SEEK_DATA, &pos)) &&
+         !(error = ext2_file_seek(f, pos, SEEK_HOLE, &end))) {
+    while (!error && pos < end) {
+      struct iovec iov = {.iov_base = data,
+                          .iov_len = min((size_t)(end - pos), COPYBUF_SIZE)};
+      size_t cnt;
+      if ((error = ext2_file_readv(f, &iov, 1, pos, &cnt)))
+        break;
+      ssize_t nwritten = pwrite(fd, data, cnt, pos);
+      if (nwritten < 0)
+        error = errno;
+      else if ((size_t)nwritten != cnt)
+        error = EIO;
+      pos += cnt;
+      copied += cnt;
+    }
+  }
+
+  /* There is no more data past the last hole. */
+  if (error == ENXIO)
+    error = 0;
+
+  close(fd);
+  ext2_close(f);
+
+  if (!error)
+    printf("%s -> %s: %zu of %ld bytes copied\n", name, arg, copied,
+           st.st_size);
+  return error;
+}
+
 static int do_stat(char *arg) {
   uint32_t ino;
   int error;
@@ -147,7 +221,8 @@ static int do_stat(char *arg) {
     return error;
 
   struct stat st;
-  ext2_stat(ino, &st);
+  if ((error = ext2_stat(ino, &st)))
+    return error;
 
   mode_t mode = st.st_mode;
   const char *type = "???";
@@ -200,7 +275,8 @@ static int do_readlink(char *arg) {
     return error;
 
   struct stat st;
-  ext2_stat(ino, &st);
+  if ((error = ext2_stat(ino, &st)))
+    return error;
 
   char symlink[st.st_size + 1];
   if ((error = ext2_readlink(ino, symlink, st.st_size)))
@@ -224,10 +300,11 @@ static int do_blocks(char *arg) {
     return ENOTSUP;
 
   struct stat st;
-  ext2_stat(ino, &st);
+  if ((error = ext2_stat(ino, &st)))
+    return error;
 
   uint32_t blkidx = 0;
-  while ((blkidx * BLKSIZE < (uint32_t)st.st_size))
+  while ((blkidx * st.st_blksize < st.st_size))
     printf("%ld ", ext2_blkaddr_read(ino, blkidx++));
   puts("");
 
@@ -264,6 +341,7 @@ static command_t commands[] = {
   {"ls", do_list},
   {"stat", do_stat},
   {"read", do_read},
+  {"get", do_get},
   {"readlink", do_readlink},
   {"blocks", do_blocks},
   {"testi", do_testi}, 
@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+/* Files are hashed through a private mapping, this much at a time. */
+#define HASH_MAPSIZE (1UL << 30)
+
+/* Largest whole number of MD5 blocks that MD5Update takes at once. */
+#define MD5_CHUNK (UINT_MAX & ~63U)
+
+static void md5_init(hash_state_t *hs) {
+  MD5Init(&hs->md5);
+}
+
+static void md5_update(hash_state_t *hs, const void *data, size_t len) {
+  const unsigned char *p = data;
+
+  /* MD5Update takes an unsigned int length. */
+  for (; len > MD5_CHUNK; len -= MD5_CHUNK, p += MD5_CHUNK)
+    MD5Update(&hs->md5, p, MD5_CHUNK);
+  MD5Update(&hs->md5, p, len);
+}
+
+static void md5_final(hash_state_t *hs, unsigned char *digest) {
+  MD5Final(digest, &hs->md5);
+}
+
+static void xxh64_init(hash_state_t *hs) {
+  XXH64Init(&hs->xxh64, 0);
+}
+
+static void xxh64_update(hash_state_t *hs, const void *data, size_t len) {
+  XXH64Update(&hs->xxh64, data, len);
+}
+
+static void xxh64_final(hash_state_t *hs, unsigned char *digest) {
+  XXH64Final(digest, &hs->xxh64);
+}
+
+static void blake3_init(hash_state_t *hs) {
+  BLAKE3Init(&hs->blake3);
+}
+
+static void blake3_update(hash_state_t *hs, const void *data, size_t len) {
+  BLAKE3Update(&hs->blake3, data, len);
+}
+
+static void blake3_final(hash_state_t *hs, unsigned char *digest) {
+  BLAKE3Final(digest, &hs->blake3);
+}
+
+const hash_engine_t hash_md5 = {"md5", MD5_DIGEST_LENGTH, md5_init,
+                                md5_update, md5_final};
+const hash_engine_t hash_xxh64 = {"xxh64", XXH64_DIGEST_LENGTH, xxh64_init,
+                                  xxh64_update, xxh64_final};
+const hash_engine_t hash_blake3 = {"blake3", BLAKE3_DIGEST_LENGTH,
+                                   blake3_init, blake3_update, blake3_final};
+
+static const hash_engine_t *engines[] = {&hash_md5, &hash_xxh64,
+                                         &hash_blake3};
+
+#define NENGINES (sizeof(engines) / sizeof(engines[0]))
+
+/* Returns engine called `name` or NULL if there is no such engine. */
+const hash_engine_t *hash_lookup(const char *name) {
+  for (size_t i = 0; i < NENGINES; i++)
+    if (!strcmp(engines[i]->he_name, name))
+      return engines[i];
+  return NULL;
+}
+
+void hash_init(hash_ctx_t *ctx, const hash_engine_t *he) {
+  ctx->hc_engine = he;
+  he->he_init(&ctx->hc_state);
+}
+
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len) {
+  ctx->hc_engine->he_update(&ctx->hc_state, data, len);
+}
+
+/* Finishes hashing and stores digest as hexadecimal string in `buf`. */
+char *hash_end(hash_ctx_t *ctx, char buf[HASH_STRING_MAX]) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char digest[HASH_DIGEST_MAX];
+  size_t len = ctx->hc_engine->he_digestlen;
+
+  ctx->hc_engine->he_final(&ctx->hc_state, digest);
+
+  for (size_t i = 0; i < len; i++) {
+    buf[2 * i] = hex[digest[i] >> 4];
+    buf[2 * i + 1] = hex[digest[i] & 15];
+  }
+  buf[2 * len] = '\0';
+  return buf;
+}
+
+/* Hashes contents of file at `path` with `he`, like MD5File. Regular files are
+ * mapped into memory and hashed straight from page cache. Returns NULL and
+ * sets errno on failure. */
+char *hash_file(const hash_engine_t *he, const char *path,
+                char buf[HASH_STRING_MAX]) {
+  unsigned char buffer[BUFSIZ];
+  struct stat sb;
+  hash_ctx_t ctx;
+  ssize_t len;
+  int fd, error;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL;
+
+  hash_init(&ctx, he);
+
+  off_t off = 0;
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+    for (; off < sb.st_size; off += HASH_MAPSIZE) {
+      size_t size = sb.st_size - off;
+      if (size > HASH_MAPSIZE)
+        size = HASH_MAPSIZE;
+
+      void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, off);
+      if (p == MAP_FAILED)
+        break;
+      (void)madvise(p, size, MADV_SEQUENTIAL);
+      hash_update(&ctx, p, size);
+      (void)munmap(p, size);
+    }
+
+    if (off >= sb.st_size) {
+      close(fd);
+      return hash_end(&ctx, buf);
+    }
+  }
+
+  /* Mapping failed or it's not a regular file, so read the rest. */
+  if (off > 0 && lseek(fd, off, SEEK_SET) < 0)
+    goto fail;
+
+  while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+    hash_update(&ctx, buffer, len);
+
+  if (len < 0)
+    goto fail;
+
+  close(fd);
+  return hash_end(&ctx, buf);
+
+fail:
+  error = errno;
+  close(fd);
+  errno = error;
+  return NULL;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "blake3.h"
+#include "md5.h"
+#include "xxhash.h"
+
+#define HASH_DIGEST_MAX BLAKE3_DIGEST_LENGTH
+#define HASH_STRING_MAX (HASH_DIGEST_MAX * 2 + 1)
+
+/* State of any of the hash engines. */
+typedef union hash_state {
+  MD5_CTX md5;
+  XXH64_CTX xxh64;
+  BLAKE3_CTX blake3;
+} hash_state_t;
+
+/* Content hash engine. The name is also used as property name in listings,
+ * so listings made with different engines are never mistaken for each other. */
+typedef struct hash_engine {
+  const char *he_name; /* short name, e.g. "md5" */
+  size_t he_digestlen; /* digest length in bytes */
+  void (*he_init)(hash_state_t *);
+  void (*he_update)(hash_state_t *, const void *, size_t);
+  void (*he_final)(hash_state_t *, unsigned char *);
+} hash_engine_t;
+
+/* Hashing in progress. */
+typedef struct hash_ctx {
+  const hash_engine_t *hc_engine;
+  hash_state_t hc_state;
+} hash_ctx_t;
+
+extern const hash_engine_t hash_md5;    /* MD5 (default, compatible) */
+extern const hash_engine_t hash_xxh64;  /* XXH64 (fast, non-cryptographic) */
+extern const hash_engine_t hash_blake3; /* BLAKE3 (fast, cryptographic) */
+
+const hash_engine_t *hash_lookup(const char *name);
+void hash_init(hash_ctx_t *ctx, const hash_engine_t *he);
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+char *hash_end(hash_ctx_t *ctx, char buf[HASH_STRING_MAX]);
+char *hash_file(const hash_engine_t *he, const char *path,
+                char buf[HASH_STRING_MAX]);
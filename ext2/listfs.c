@@ -2,13 +2,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdnoreturn.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "md5.h"
+#include "hash.h"
+
+static const hash_engine_t *hasher = &hash_md5; /* content hash engine */
 
 static int showfile(const char *path) {
   struct stat sb[1];
@@ -24,9 +27,9 @@ static int showfile(const char *path) {
 
   switch (sb->st_mode & S_IFMT) {
     case S_IFREG: {
-      char *md5sum = MD5File(path, NULL);
-      printf(" md5=%s", md5sum);
-      free(md5sum);
+      char digest[HASH_STRING_MAX];
+      printf(" %s=%s", hasher->he_name,
+             hash_file(hasher, path, digest) ? digest : "?");
       break;
     }
     case S_IFLNK: {
@@ -72,9 +75,28 @@ static int listdir(const char *path) {
   return 0;
 }
 
+static noreturn void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-a hash] [directory]\n", prog);
+  fprintf(stderr, "  -a  content hash: md5 (default), xxh64 or blake3\n");
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc == 2) {
-    if (chdir(argv[1])) {
+  int ch;
+
+  while ((ch = getopt(argc, argv, "a:")) != -1) {
+    switch (ch) {
+      case 'a':
+        if (!(hasher = hash_lookup(optarg)))
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (optind + 1 == argc) {
+    if (chdir(argv[optind])) {
       perror("chdir");
       exit(EXIT_FAILURE);
     }
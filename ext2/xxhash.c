@@ -0,0 +1,146 @@
+/*
+ * xxHash - Extremely Fast Hash algorithm (XXH64 variant).
+ * Copyright (C) 2012-2021 Yann Collet
+ *
+ * BSD 2-Clause License (https://www.opensource.org/licenses/bsd-license.php)
+ *
+ * This is a streaming-only rewrite of XXH64 from the reference xxhash.h.
+ * Digest is stored in canonical (big-endian) form, as printed by xxhsum.
+ */
+
+#include <string.h>
+
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/* Input is read as little-endian words, as on the machines we target. */
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t XXH64Round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = ROTL64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t XXH64Merge(uint64_t acc, uint64_t val) {
+  acc ^= XXH64Round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consumes whole stripes of 32 bytes. Returns number of bytes consumed. */
+static size_t XXH64Stripes(uint64_t acc[4], const unsigned char *p,
+                           size_t len) {
+  uint64_t v1 = acc[0], v2 = acc[1], v3 = acc[2], v4 = acc[3];
+  size_t done = 0;
+
+  for (; done + XXH64_BLOCK_LENGTH <= len; done += XXH64_BLOCK_LENGTH) {
+    v1 = XXH64Round(v1, read64(p + done));
+    v2 = XXH64Round(v2, read64(p + done + 8));
+    v3 = XXH64Round(v3, read64(p + done + 16));
+    v4 = XXH64Round(v4, read64(p + done + 24));
+  }
+
+  acc[0] = v1;
+  acc[1] = v2;
+  acc[2] = v3;
+  acc[3] = v4;
+  return done;
+}
+
+void XXH64Init(XXH64_CTX *ctx, uint64_t seed) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->acc[0] = seed + PRIME64_1 + PRIME64_2;
+  ctx->acc[1] = seed + PRIME64_2;
+  ctx->acc[2] = seed;
+  ctx->acc[3] = seed - PRIME64_1;
+}
+
+void XXH64Update(XXH64_CTX *ctx, const void *in, size_t len) {
+  const unsigned char *input = in;
+
+  ctx->total += len;
+
+  if (ctx->buflen + len < XXH64_BLOCK_LENGTH) {
+    memcpy(ctx->buffer + ctx->buflen, input, len);
+    ctx->buflen += len;
+    return;
+  }
+
+  /* Complete buffered stripe first. */
+  if (ctx->buflen > 0) {
+    size_t fill = XXH64_BLOCK_LENGTH - ctx->buflen;
+    memcpy(ctx->buffer + ctx->buflen, input, fill);
+    XXH64Stripes(ctx->acc, ctx->buffer, XXH64_BLOCK_LENGTH);
+    input += fill;
+    len -= fill;
+  }
+
+  size_t done = XXH64Stripes(ctx->acc, input, len);
+  ctx->buflen = len - done;
+  memcpy(ctx->buffer, input + done, ctx->buflen);
+}
+
+void XXH64Final(unsigned char digest[XXH64_DIGEST_LENGTH], XXH64_CTX *ctx) {
+  const unsigned char *p = ctx->buffer;
+  size_t len = ctx->buflen;
+  uint64_t h;
+
+  if (ctx->total >= XXH64_BLOCK_LENGTH) {
+    uint64_t *v = ctx->acc;
+    h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) +
+        ROTL64(v[3], 18);
+    h = XXH64Merge(h, v[0]);
+    h = XXH64Merge(h, v[1]);
+    h = XXH64Merge(h, v[2]);
+    h = XXH64Merge(h, v[3]);
+  } else {
+    h = ctx->acc[2] + PRIME64_5;
+  }
+
+  h += ctx->total;
+
+  for (; len >= 8; len -= 8, p += 8) {
+    h ^= XXH64Round(0, read64(p));
+    h = ROTL64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  if (len >= 4) {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = ROTL64(h, 23) * PRIME64_2 + PRIME64_3;
+    len -= 4;
+    p += 4;
+  }
+
+  for (; len > 0; len--, p++) {
+    h ^= *p * PRIME64_5;
+    h = ROTL64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+
+  for (int i = 0; i < XXH64_DIGEST_LENGTH; i++)
+    digest[i] = h >> (56 - 8 * i);
+
+  memset(ctx, 0, sizeof(*ctx));
+}
@@ -0,0 +1,29 @@
+/*
+ * xxHash - Extremely Fast Hash algorithm (XXH64 variant).
+ * Copyright (C) 2012-2021 Yann Collet
+ *
+ * BSD 2-Clause License (https://www.opensource.org/licenses/bsd-license.php)
+ */
+
+#ifndef _XXHASH_H_
+#define _XXHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH64_BLOCK_LENGTH 32
+#define XXH64_DIGEST_LENGTH 8
+
+/* XXH64 context. */
+typedef struct XXH64Context {
+  uint64_t total;                           /* number of bytes hashed */
+  uint64_t acc[4];                          /* accumulator lanes */
+  unsigned char buffer[XXH64_BLOCK_LENGTH]; /* input buffer */
+  unsigned buflen;                          /* bytes in input buffer */
+} XXH64_CTX;
+
+void XXH64Init(XXH64_CTX *, uint64_t);
+void XXH64Update(XXH64_CTX *, const void *, size_t);
+void XXH64Final(unsigned char[static XXH64_DIGEST_LENGTH], XXH64_CTX *);
+
+#endif /* _XXHASH_H_ */